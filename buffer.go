@@ -1,11 +1,13 @@
 package main
 
-// Data structures and methods for managing a file buffer, its content (lines of
-// runes), and multiple cursors.
+// Data structures and methods for managing a file buffer, its content (UTF-8
+// lines), and multiple cursors.
 
 import (
-	"strings"
 	"time"
+	"unicode/utf8"
+
+	sitter "github.com/mitjafelicijan/go-tree-sitter"
 )
 
 // Cursor represents a position in the buffer.
@@ -15,15 +17,10 @@ type Cursor struct {
 	PreferredCol int // Remembers the intended column when moving up/down.
 }
 
-// HistoryState stores a snapshot of the buffer and cursors for undo/redo.
-type HistoryState struct {
-	buffer  [][]rune
-	cursors []Cursor
-}
-
 // Buffer represents an open file and its associated editor state.
 type Buffer struct {
-	buffer      [][]rune           // Slice of lines, where each line is a slice of runes.
+	text        rope               // Lines of the buffer as UTF-8; see line and setLine.
+	decoded     runeCache          // Recently used lines as runes; see line.
 	cursors     []Cursor           // Support for multiple cursors.
 	scrollX     int                // Horizontal scroll offset.
 	scrollY     int                // Vertical scroll offset.
@@ -32,9 +29,13 @@ type Buffer struct {
 	readOnly    bool               // True if the buffer cannot be edited.
 	undoStack   []HistoryState     // For undo functionality.
 	redoStack   []HistoryState     // For redo functionality.
+	undoBytes   int                // Memory held by undoStack, see Config.UndoMemory.
+	mark        *historyMark       // Start of the current undoable action.
 	fileType    *FileType          // Language-specific settings.
 	lspClient   *LSPClient         // Associated LSP client for this buffer.
 	diagnostics []Diagnostic       // Errors/warnings for this buffer.
+	diagIndex   diagnosticIndex    // The diagnostics indexed by line.
+	diagVersion int64              // Version of diagnostics, see refreshDiagnostics.
 	syntax      *SyntaxHighlighter // Syntax highlighting engine.
 	lastModTime time.Time          // Last modified time of the file on disk.
 }
@@ -61,6 +62,140 @@ func (b *Buffer) ClearCursors() {
 	}
 }
 
+// The methods below are the only way the text of a buffer is read and
+// modified, so the editing code does not depend on how lines are stored.
+
+// line returns line y as runes. Lines are stored as UTF-8 and decoded on
+// demand, so the returned slice must not be modified.
+func (b *Buffer) line(y int) []rune {
+	return b.decoded.get(b.text.line(y))
+}
+
+// lineString returns line y as UTF-8.
+func (b *Buffer) lineString(y int) string {
+	return b.text.line(y)
+}
+
+// lineLen returns the number of runes in line y without decoding it.
+func (b *Buffer) lineLen(y int) int {
+	return b.text.runeCount(y)
+}
+
+// lineCount returns the number of lines in the buffer.
+func (b *Buffer) lineCount() int {
+	return b.text.len()
+}
+
+// setLine replaces line y. Lines must not be modified in place.
+func (b *Buffer) setLine(y int, line []rune) {
+	b.text = b.text.set(y, string(line))
+}
+
+// insertLines inserts lines before line y.
+func (b *Buffer) insertLines(y int, lines ...[]rune) {
+	text := make([]string, len(lines))
+	for i, line := range lines {
+		text[i] = string(line)
+	}
+	b.text = b.text.insert(y, text)
+}
+
+// deleteLines removes lines [start, end).
+func (b *Buffer) deleteLines(start, end int) {
+	b.text = b.text.delete(start, end)
+}
+
+// setLines replaces all lines of the buffer. The lines must be valid UTF-8,
+// see validUTF8.
+func (b *Buffer) setLines(lines []string) {
+	b.text = newRope(lines)
+}
+
+// byteCol converts rune column col of line y to a byte column, clamped to the
+// end of the line.
+func (b *Buffer) byteCol(y, col int) uint32 {
+	line := b.text.line(y)
+	if b.text.isASCII(y) {
+		return uint32(max(min(col, len(line)), 0))
+	}
+
+	offset := 0
+	for ; col > 0 && offset < len(line); col-- {
+		_, size := utf8.DecodeRuneInString(line[offset:])
+		offset += size
+	}
+	return uint32(offset)
+}
+
+// runeCol converts byte column colBytes of line y to a rune column. A byte
+// column inside a rune maps to that rune.
+func (b *Buffer) runeCol(y int, colBytes uint32) int {
+	line := b.text.line(y)
+	if b.text.isASCII(y) {
+		return min(int(colBytes), len(line))
+	}
+
+	col := 0
+	for offset := 0; offset < len(line); col++ {
+		_, size := utf8.DecodeRuneInString(line[offset:])
+		if offset+size > int(colBytes) {
+			break
+		}
+		offset += size
+	}
+	return col
+}
+
+// lspPosition converts rune column x of line y to an LSP position counted in
+// the code units of enc. UTF-8 matches the text of the buffer, and ASCII
+// lines count the same in every encoding, so only other lines are scanned.
+func (b *Buffer) lspPosition(enc positionEncoding, y, x int) Position {
+	pos := Position{Line: y, Character: x}
+	if y < 0 || y >= b.lineCount() {
+		return pos
+	}
+
+	switch {
+	case enc == encodingUTF8:
+		pos.Character = int(b.byteCol(y, x))
+	case enc == encodingUTF32 || b.text.isASCII(y):
+		pos.Character = max(min(x, b.lineLen(y)), 0)
+	default:
+		pos.Character = enc.length(b.text.line(y)[:b.byteCol(y, x)])
+	}
+	return pos
+}
+
+// lspColumn converts an LSP character offset on line y, counted in the code
+// units of enc, to a rune column, clamped to the line. An offset inside a
+// character maps to it.
+func (b *Buffer) lspColumn(enc positionEncoding, y, character int) int {
+	if y < 0 || y >= b.lineCount() {
+		return 0
+	}
+
+	switch {
+	case enc == encodingUTF8:
+		return b.runeCol(y, uint32(max(character, 0)))
+	case enc == encodingUTF32 || b.text.isASCII(y):
+		return max(min(character, b.lineLen(y)), 0)
+	}
+
+	col, units := 0, 0
+	for _, r := range b.text.line(y) {
+		if r >= 0x10000 {
+			units += 2 // Encoded as a surrogate pair.
+		} else {
+			units++
+		}
+		if units > character {
+			break
+		}
+		col++
+	}
+	return col
+}
+
 // getLineByteOffset calculates the byte index for a given column in a line of
 // runes.
 func (b *Buffer) getLineByteOffset(line []rune, col int) uint32 {
@@ -68,41 +203,128 @@ func (b *Buffer) getLineByteOffset(line []rune, col int) uint32 {
 	if col > len(line) {
 		col = len(line)
 	}
-	return uint32(len(string(line[:col])))
+	return byteLen(line[:col])
 }
 
 // getByteOffset calculates the total byte offset from the start of the buffer
 // to (row, col).
 func (b *Buffer) getByteOffset(row, col int) uint32 {
-	var offset uint32
-	for i := 0; i < row && i < len(b.buffer); i++ {
-		offset += uint32(len(string(b.buffer[i]))) + 1 // +1 for the newline character.
+	offset := b.text.lineStart(row)
+	if row < b.lineCount() {
+		offset += b.byteCol(row, col)
 	}
+	return offset
+}
 
-	if row < len(b.buffer) {
-		offset += b.getLineByteOffset(b.buffer[row], col)
+// getPosition converts a byte offset from the start of the buffer to a row
+// and a rune column.
+func (b *Buffer) getPosition(offset uint32) (int, int) {
+	row, colBytes := b.text.lineAt(offset)
+	if row >= b.lineCount() {
+		return row, 0
 	}
-	return offset
+	return row, b.runeCol(row, colBytes)
+}
+
+// byteLen returns the length of runes in UTF-8.
+func byteLen(runes []rune) uint32 {
+	var n uint32
+	for _, r := range runes {
+		n += uint32(runeLen(r))
+	}
+	return n
+}
+
+// runeLen returns the number of bytes r takes in the UTF-8 text of the buffer.
+// Runes that can't be encoded are written as utf8.RuneError.
+func runeLen(r rune) int {
+	if size := utf8.RuneLen(r); size > 0 {
+		return size
+	}
+	return utf8.RuneLen(utf8.RuneError)
 }
 
 // toString converts the entire buffer (slice of lines) into a single string.
 func (b *Buffer) toString() string {
-	var result strings.Builder
-	for i, line := range b.buffer {
-		result.WriteString(string(line))
-		if i < len(b.buffer)-1 {
-			result.WriteString("\n")
-		}
+	return b.text.String()
+}
+
+// snapshot returns the current lines in a form that is not affected by later
+// edits. The rope is never modified in place, so this is O(1).
+func (b *Buffer) snapshot() rope {
+	return b.text
+}
+
+// syncLSP hands the current text to the LSP client, which sends the changes
+// since the last sync once editing pauses. The client compares the text the
+// server has with this snapshot, so every edit is covered, whether or not it
+// was reported through handleEdit.
+func (b *Buffer) syncLSP() {
+	if b.lspClient != nil {
+		b.lspClient.Update(b.snapshot())
 	}
-	return result.String()
 }
 
-// handleEdit is a placeholder for incremental syntax highlighting updates.
+// handleEdit describes an edit to the syntax tree so the next Reparse can reuse
+// the unchanged parts of the old tree. It must be called after the buffer has
+// been modified; startCol is a rune column, the end columns are byte columns.
 func (b *Buffer) handleEdit(startRow, startCol int, bytesRemoved, bytesAdded uint32, oldEndRow int, oldEndColBytes uint32, newEndRow int, newEndColBytes uint32) {
-	if b.syntax == nil {
+	if b.syntax == nil || startRow >= b.lineCount() {
 		return
 	}
 
-	// We batch syntax updates in editor.go via Reparse, so we don't need
-	// incremental updates here.
+	// Everything before the start of the edit is unchanged, so the start
+	// position can be computed from the already modified buffer.
+	startByte := b.getByteOffset(startRow, startCol)
+	startColBytes := b.byteCol(startRow, startCol)
+
+	b.syntax.Edit(sitter.EditInput{
+		StartIndex:  startByte,
+		OldEndIndex: startByte + bytesRemoved,
+		NewEndIndex: startByte + bytesAdded,
+		StartPoint:  sitter.Point{Row: uint32(startRow), Column: startColBytes},
+		OldEndPoint: sitter.Point{Row: uint32(oldEndRow), Column: oldEndColBytes},
+		NewEndPoint: sitter.Point{Row: uint32(newEndRow), Column: newEndColBytes},
+	})
+}
+
+// validUTF8 returns s with every invalid byte replaced by utf8.RuneError, the
+// same way converting it to runes would, so byte lengths of stored lines
+// match their runes.
+func validUTF8(s string) string {
+	if utf8.ValidString(s) {
+		return s
+	}
+	return string([]rune(s))
+}
+
+// runeCacheSize is the number of decoded lines kept by a runeCache.
+const runeCacheSize = 8
+
+// runeCache keeps the runes of recently decoded lines, since editing commands
+// read the lines around the cursor many times. Entries are keyed by the line
+// text, so edits need no invalidation.
+type runeCache struct {
+	text  [runeCacheSize]string
+	runes [runeCacheSize][]rune
+	next  int // Entry to replace next.
+}
+
+// get returns line as runes.
+func (c *runeCache) get(line string) []rune {
+	if line == "" {
+		return nil
+	}
+	for i := range c.text {
+		if c.runes[i] != nil && c.text[i] == line {
+			return c.runes[i]
+		}
+	}
+
+	runes := []rune(line)
+	runes = runes[:len(runes):len(runes)] // Appending must copy.
+	c.text[c.next] = line
+	c.runes[c.next] = runes
+	c.next = (c.next + 1) % runeCacheSize
+	return runes
 }
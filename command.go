@@ -222,8 +222,7 @@ func (ch *Command) quit(force bool) {
 			}
 		}
 	}
-	termbox.Close()
-	os.Exit(0)
+	ch.e.exit(0, "")
 }
 
 // write saves the current active buffer to disk.
@@ -275,8 +274,7 @@ func (ch *Command) writeQuit() {
 			ch.e.pendingConfirm = func() {
 				err := ch.e.SaveFile(true)
 				if err == nil {
-					termbox.Close()
-					os.Exit(0)
+					ch.e.exit(0, "")
 				} else {
 					ch.e.message = err.Error()
 				}
@@ -285,8 +283,7 @@ func (ch *Command) writeQuit() {
 			ch.e.message = err.Error()
 		}
 	} else {
-		termbox.Close()
-		os.Exit(0)
+		ch.e.exit(0, "")
 	}
 }
 
@@ -315,15 +312,15 @@ func (ch *Command) writeAll() {
 		}
 
 		writer := bufio.NewWriter(file)
-		for i, line := range b.buffer {
-			_, err := writer.WriteString(string(line))
+		for i := 0; i < b.lineCount(); i++ {
+			_, err := writer.WriteString(b.lineString(i))
 			if err != nil {
 				file.Close()
 				lastErr = err
 				continue
 			}
 			// Write newline if not the last line (or if buffer should end with newline).
-			if i < len(b.buffer)-1 || (len(b.buffer) > 0 && (len(b.buffer) > 1 || len(b.buffer[0]) > 0)) {
+			if i < b.lineCount()-1 || (b.lineCount() > 0 && (b.lineCount() > 1 || b.lineLen(0) > 0)) {
 				_, err = writer.WriteString("\n")
 				if err != nil {
 					file.Close()
@@ -388,8 +385,8 @@ func (ch *Command) goToLine(lineNum int) {
 		if targetY < 0 {
 			targetY = 0
 		}
-		if targetY >= len(b.buffer) {
-			targetY = len(b.buffer) - 1
+		if targetY >= b.lineCount() {
+			targetY = b.lineCount() - 1
 		}
 		b.PrimaryCursor().Y = targetY
 		b.PrimaryCursor().X = 0
@@ -504,29 +501,28 @@ func (ch *Command) readShell(shellCmd string) {
 	currentY := c.Y
 
 	// Insert output starting from the line after the cursor.
+	newLines := make([][]rune, len(lines))
 	for i, line := range lines {
-		insertY := currentY + i + 1
-		// Create new line in buffer.
-		newLine := []rune(line)
-		// Insert the line into the buffer.
-		if insertY <= len(b.buffer) {
-			b.buffer = append(b.buffer[:insertY], append([][]rune{newLine}, b.buffer[insertY:]...)...)
-		} else {
-			b.buffer = append(b.buffer, newLine)
-		}
+		newLines[i] = []rune(line)
 	}
+	b.insertLines(currentY+1, newLines...)
 
 	// Mark buffer as modified.
 	ch.e.markModified()
 
 	// Reparse syntax if needed.
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
-	}
-
-	// Notify LSP of the change.
-	if b.lspClient != nil {
-		b.lspClient.SendDidChange(b.toString())
+		// The output was inserted as "\nline..." at the end of the cursor line.
+		// The lines are counted as stored: invalid UTF-8 in the output was
+		// replaced when it was converted to runes.
+		insertedBytes := uint32(0)
+		lastRow := currentY + len(lines)
+		for row := currentY + 1; row <= lastRow; row++ {
+			insertedBytes += uint32(len(b.lineString(row))) + 1
+		}
+		endCol := b.byteCol(currentY, b.lineLen(currentY))
+		b.handleEdit(currentY, b.lineLen(currentY), 0, insertedBytes, currentY, endCol, lastRow, uint32(len(b.lineString(lastRow))))
+		b.syntax.Reparse(b.snapshot())
 	}
 
 	lineCount := len(lines)
@@ -5,6 +5,7 @@ package main
 
 import (
 	"flag"
+	"strings"
 	"time"
 )
 
@@ -19,12 +20,15 @@ type Configuration struct {
 	NumLogsInDebugWindow int           // How many recent logs to show in the UI debug window.
 	OllamaCheckInterval  time.Duration // How often to check if Ollama is running.
 	FileCheckInterval    time.Duration // How often to check for external file changes.
+	UndoMemory           int           // Memory budget of the undo history of each buffer, in MB.
+	LSPSyncDelay         time.Duration // How long edits must pause before they are sent to LSP.
 	OllamaURL            string        // Endpoint for the Ollama AI service.
 	OllamaModel          string        // The specific AI model to use for completion.
 	DevMode              bool          // Enables verbose logging and developer tools.
 	ShowColors           bool          // Command-line flag to show available colors and exit.
 	ShowInfo             bool          // Command-line flag to show file types and exit.
 	ShowVersion          bool          // Command-line flag to show version and exit.
+	FuzzyExclude         []string      // Patterns the file finder skips, in .gitignore syntax.
 	FormatterMarkers     []string      // List of comment prefixes for text formatting (no CLI flag).
 }
 
@@ -34,16 +38,20 @@ var Config Configuration
 // InitConfig sets up command-line flags and parses them into the global Config.
 func InitConfig() {
 	var leaderKey string
+	var fuzzyExclude string
 
 	flag.IntVar(&Config.GutterWidth, "gutter-width", 7, "Width of the gutter")
 	flag.IntVar(&Config.DefaultTabWidth, "tab-width", 4, "Default tab width")
 	flag.IntVar(&Config.FuzzyFinderHeight, "fuzzy-height", 8, "Height of fuzzy finder")
+	flag.StringVar(&fuzzyExclude, "fuzzy-exclude", ".git,node_modules", "Comma-separated patterns the file finder skips, in addition to .gitignore")
 	flag.StringVar(&leaderKey, "leader", "\\", "Leader key")
 	flag.BoolVar(&Config.UseLogFile, "log", false, "Enable logging to file")
 	flag.StringVar(&Config.LogFilePath, "log-path", "/tmp/qwe-editor-debug.log", "Path to log file")
 	flag.IntVar(&Config.NumLogsInDebugWindow, "num-logs", 10, "Number of logs in debug window")
 	flag.DurationVar(&Config.OllamaCheckInterval, "ollama-interval", 5*time.Second, "Ollama check interval")
 	flag.DurationVar(&Config.FileCheckInterval, "file-check-interval", 2*time.Second, "File check interval")
+	flag.IntVar(&Config.UndoMemory, "undo-memory", 16, "Undo history memory per buffer in MB")
+	flag.DurationVar(&Config.LSPSyncDelay, "lsp-sync-delay", 200*time.Millisecond, "Delay before edits are sent to LSP")
 	flag.StringVar(&Config.OllamaURL, "ollama-url", "http://localhost:11434", "Ollama URL")
 	flag.StringVar(&Config.OllamaModel, "ollama-model", "qwen2.5-coder:latest", "Ollama model")
 	flag.BoolVar(&Config.DevMode, "dev", false, "Enable development mode")
@@ -58,6 +66,13 @@ func InitConfig() {
 		Config.LeaderKey = rune(leaderKey[0])
 	}
 
+	// Split the exclude patterns of the file finder.
+	for _, pattern := range strings.Split(fuzzyExclude, ",") {
+		if pattern = strings.TrimSpace(pattern); pattern != "" {
+			Config.FuzzyExclude = append(Config.FuzzyExclude, pattern)
+		}
+	}
+
 	// Initialize formatter markers for text formatting.
 	Config.FormatterMarkers = []string{
 		"//", // C/C++/Go/JavaScript/Rust
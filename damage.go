@@ -0,0 +1,305 @@
+package main
+
+// State draw keeps between frames.
+//
+// Damage tracking: each text row is summarized by a hash of
+// everything that decides how it looks, and a row whose hash did not change
+// since the last frame is left on the screen as it is instead of being
+// cleared and painted again. termbox only sends changed cells to the
+// terminal, so an idle frame costs little more than hashing the visible
+// lines.
+//
+// Scratch buffers: the runes, colors and search matches of the row being
+// drawn, and the text of the status and command bars, live in buffers that
+// are reused by every row and frame, so drawing does not allocate once they
+// are large enough for the longest visible line.
+
+import (
+	"encoding/binary"
+	"hash/maphash"
+	"slices"
+	"strconv"
+	"strings"
+	"unicode"
+	"unicode/utf8"
+
+	"github.com/nsf/termbox-go"
+)
+
+// screenState remembers what the last frame drew.
+type screenState struct {
+	frame   frameKey
+	rows    []uint64 // Hash of each text row, see rowHash.
+	overlay bool     // Something was drawn over the text rows.
+	seed    maphash.Seed
+}
+
+// frameKey holds what all text rows depend on. Any change to it repaints
+// all of them.
+type frameKey struct {
+	width    int
+	height   int
+	rows     int
+	buffer   *Buffer
+	fileType *FileType
+	scrollX  int
+	search   string
+	palette  *palette
+}
+
+// beginFrame starts a frame and reports whether all text rows must be
+// repainted. overlay tells whether popups or panels will be drawn over them;
+// they may cover any cell, so frames with or after one are repainted whole.
+func (s *screenState) beginFrame(key frameKey, overlay bool) bool {
+	if s.seed == (maphash.Seed{}) {
+		s.seed = maphash.MakeSeed()
+	}
+
+	full := key != s.frame || overlay || s.overlay
+	if full {
+		if len(s.rows) != key.rows {
+			s.rows = make([]uint64, max(key.rows, 0))
+		}
+		clear(s.rows)
+	}
+	s.frame = key
+	s.overlay = overlay
+	return full
+}
+
+// rowChanged records the hash of text row y and reports whether it differs
+// from the one drawn last.
+func (s *screenState) rowChanged(y int, hash uint64) bool {
+	if s.rows[y] == hash {
+		return false
+	}
+	s.rows[y] = hash
+	return true
+}
+
+// rowHash accumulates the inputs of a text row.
+type rowHash struct {
+	h   maphash.Hash
+	buf [8]byte
+}
+
+func (r *rowHash) reset(seed maphash.Seed) {
+	r.h.SetSeed(seed)
+}
+
+func (r *rowHash) int(v int) {
+	binary.LittleEndian.PutUint64(r.buf[:], uint64(v))
+	r.h.Write(r.buf[:])
+}
+
+func (r *rowHash) string(s string) {
+	r.int(len(s))
+	r.h.WriteString(s)
+}
+
+// sum returns the hash. It is never 0, which marks rows that were not drawn.
+func (r *rowHash) sum() uint64 {
+	return r.h.Sum64() | 1
+}
+
+// hashTextRow adds what text row bufferY of b shows to h: the line, its
+// number, highlights, diagnostics and cursors, which are the cursors of the
+// row in the order of drawScratch.sortCursors. The visual selection is added
+// by draw.
+func (e *Editor) hashTextRow(h *rowHash, b *Buffer, bufferY int, cursors []Cursor) {
+	h.int(bufferY)
+	if bufferY >= b.lineCount() {
+		return
+	}
+	h.string(b.lineString(bufferY))
+
+	if b.syntax != nil && b.fileType != nil && b.fileType.Name != "Default" {
+		b.syntax.hashLine(bufferY, h)
+	}
+
+	if d := b.diagIndex.at(bufferY); d != nil {
+		h.int(d.severity)
+		for _, span := range d.spans {
+			h.int(span.start)
+			h.int(span.end)
+		}
+	}
+
+	h.int(len(cursors))
+	for _, c := range cursors {
+		h.int(c.X)
+	}
+	if bufferY == b.PrimaryCursor().Y {
+		h.int(-1)
+	}
+}
+
+// clearRow clears screen row y the way termbox.Clear in draw clears the
+// whole screen.
+func clearRow(y, width int) {
+	_, bg := GetThemeColor(ColorDefault)
+	for x := 0; x < width; x++ {
+		termbox.SetCell(x, y, ' ', termbox.ColorDefault, bg)
+	}
+}
+
+// drawScratch holds the buffers draw reuses for every row.
+type drawScratch struct {
+	runes       []rune              // Line of the row, see line.
+	fg          []termbox.Attribute // Foreground of each rune of the row.
+	bg          []termbox.Attribute // Background of each rune of the row.
+	matches     []bool              // Runes of the row inside a search match.
+	number      []byte              // Line number of the row.
+	cursors     []Cursor            // Cursors of the buffer, see sortCursors.
+	search      string              // Query searchRunes was made from.
+	searchRunes []rune              // search in lower case.
+	status      []byte              // Text of the status or command bar.
+}
+
+// resize returns s with length n, reusing its array when it is large enough.
+func resize[T any](s []T, n int) []T {
+	if cap(s) < n {
+		return make([]T, n, n+n/4)
+	}
+	return s[:n]
+}
+
+// line decodes line y of b and sizes fg and bg to match it. The runes are
+// valid until the next call.
+func (d *drawScratch) line(b *Buffer, y int) []rune {
+	d.runes = d.runes[:0]
+	for _, r := range b.lineString(y) {
+		d.runes = append(d.runes, r)
+	}
+	d.fg = resize(d.fg, len(d.runes))
+	d.bg = resize(d.bg, len(d.runes))
+	return d.runes
+}
+
+// lineNumber formats line number n.
+func (d *drawScratch) lineNumber(n int) []byte {
+	d.number = strconv.AppendInt(d.number[:0], int64(n), 10)
+	return d.number
+}
+
+// sortCursors copies cursors ordered by row and column, so draw can take
+// the cursors of each row in turn.
+func (d *drawScratch) sortCursors(cursors []Cursor) {
+	d.cursors = append(d.cursors[:0], cursors...)
+	slices.SortFunc(d.cursors, func(a, b Cursor) int {
+		if a.Y != b.Y {
+			return a.Y - b.Y
+		}
+		return a.X - b.X
+	})
+}
+
+// searchMatches marks the runes of line inside a case-insensitive match of
+// query. It returns nil if query is empty.
+func (d *drawScratch) searchMatches(line []rune, query string) []bool {
+	if query == "" {
+		return nil
+	}
+	if query != d.search {
+		d.search = query
+		d.searchRunes = []rune(strings.ToLower(query))
+	}
+
+	d.matches = resize(d.matches, len(line))
+	clear(d.matches)
+	queryRunes := d.searchRunes
+	for i := 0; i <= len(line)-len(queryRunes); i++ {
+		match := true
+		for j, q := range queryRunes {
+			if unicode.ToLower(line[i+j]) != q {
+				match = false
+				break
+			}
+		}
+		if match {
+			for k := range queryRunes {
+				d.matches[i+k] = true
+			}
+		}
+	}
+	return d.matches
+}
+
+// drawText draws the UTF-8 text s on screen row y from column x, one cell per
+// rune, and stops at column end. Unlike ranging over string(s) it never copies
+// s.
+func drawText(s []byte, x, y, end int, fg, bg termbox.Attribute) {
+	for len(s) > 0 && x < end {
+		r, size := utf8.DecodeRune(s)
+		termbox.SetCell(x, y, r, fg, bg)
+		s = s[size:]
+		x++
+	}
+}
+
+// fileStatus formats the file name and state shown in the status bar.
+func (d *drawScratch) fileStatus(b *Buffer) []byte {
+	s := d.status[:0]
+	if b.filename == "" {
+		s = append(s, "[no file]"...)
+	} else {
+		s = append(s, b.filename...)
+	}
+	if b.modified {
+		s = append(s, " [+]"...)
+	}
+	if b.readOnly {
+		s = append(s, " (read-only)"...)
+	}
+	d.status = s
+	return s
+}
+
+// positionStatus formats the file type, buffer number and cursor position
+// shown on the right of the status bar, like "(go) [1/2] 10,4 50% ".
+func (d *drawScratch) positionStatus(fileType *FileType, buffer, buffers, line, col, percent int) []byte {
+	s := append(d.status[:0], '(')
+	if fileType == nil {
+		s = append(s, "text"...)
+	} else {
+		for _, r := range fileType.Name {
+			s = utf8.AppendRune(s, unicode.ToLower(r))
+		}
+	}
+	s = append(s, ") ["...)
+	s = strconv.AppendInt(s, int64(buffer), 10)
+	s = append(s, '/')
+	s = strconv.AppendInt(s, int64(buffers), 10)
+	s = append(s, "] "...)
+	s = strconv.AppendInt(s, int64(line), 10)
+	s = append(s, ',')
+	s = strconv.AppendInt(s, int64(col), 10)
+	s = append(s, ' ')
+	s = strconv.AppendInt(s, int64(percent), 10)
+	s = append(s, "% "...)
+	d.status = s
+	return s
+}
+
+// diagSummary formats the number of diagnostics of b, which has some, and
+// the first one's message, cut to fit width.
+func (d *drawScratch) diagSummary(b *Buffer, width int) []byte {
+	s := d.status[:0]
+	if errors := b.diagIndex.errors; errors > 0 {
+		s = strconv.AppendInt(s, int64(errors), 10)
+		s = append(s, " error(s): "...)
+	} else {
+		s = strconv.AppendInt(s, int64(len(b.diagnostics)), 10)
+		s = append(s, " diag(s): "...)
+	}
+
+	msg := b.diagnostics[0].Message
+	if maxLen := width - len(s); len(msg) > maxLen {
+		s = append(s, msg[:max(maxLen-3, 0)]...)
+		s = append(s, "..."...)
+	} else {
+		s = append(s, msg...)
+	}
+	d.status = s
+	return s
+}
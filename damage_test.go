@@ -0,0 +1,138 @@
+package main
+
+import (
+	"fmt"
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+	"time"
+
+	"github.com/nsf/termbox-go"
+)
+
+// newDrawEditor returns an editor showing a Python file of 400 lines with
+// multi-byte text, highlighting, a diagnostic, a search and three cursors.
+func newDrawEditor(tb testing.TB) *Editor {
+	tb.Helper()
+	Config.GutterWidth = 7
+	Config.DefaultTabWidth = 4
+	Config.FuzzyFinderHeight = 8
+	Config.UndoMemory = 16
+	InitFileTypes()
+
+	var text strings.Builder
+	for i := 0; i < 200; i++ {
+		fmt.Fprintf(&text, "def f%d(x):\n\treturn x + %d  # line é😀 %d\n", i, i, i)
+	}
+	filename := filepath.Join(tb.TempDir(), "draw.py")
+	if err := os.WriteFile(filename, []byte(text.String()), 0o644); err != nil {
+		tb.Fatal(err)
+	}
+
+	e := NewEditor(false)
+	if err := e.LoadFile(filename); err != nil {
+		tb.Fatal(err)
+	}
+	buf := e.activeBuffer()
+	buf.AddCursor(4, 3)
+	buf.AddCursor(6, 301)
+	buf.diagnostics = []Diagnostic{{Severity: 1, Message: "undefined name"}}
+	buf.diagnostics[0].Range.Start.Line = 301
+	buf.diagnostics[0].Range.End.Line = 301
+	buf.diagnostics[0].Range.End.Character = 5
+	buf.diagIndex = newDiagnosticIndex(buf.diagnostics, buf, encodingUTF32)
+	e.lastSearch = "return"
+	return e
+}
+
+// steadyAllocs fails unless f stops allocating. The highlighter's worker
+// allocates while it catches up with the file and counts towards f, so f is
+// measured until the worker is done.
+func steadyAllocs(tb testing.TB, name string, f func()) {
+	tb.Helper()
+	var n float64
+	for try := 0; try < 20; try++ {
+		time.Sleep(20 * time.Millisecond)
+		if n = testing.AllocsPerRun(100, f); n == 0 {
+			return
+		}
+	}
+	tb.Fatalf("%s allocates %.1f times", name, n)
+}
+
+// TestDrawScratchAllocs checks, without a terminal, that the per-row and
+// status bar work of a frame does not allocate once the scratch buffers are
+// large enough: decoding, highlighting and searching a row, hashing it for
+// damage tracking, and formatting the status bar.
+func TestDrawScratchAllocs(t *testing.T) {
+	e := newDrawEditor(t)
+	b := e.activeBuffer()
+	d := &e.scratch
+	var h rowHash
+	var screen screenState
+	key := frameKey{width: 80, height: 24, rows: 22, buffer: b}
+
+	row := func() {
+		screen.beginFrame(key, false)
+		d.sortCursors(b.cursors)
+		for y := 290; y < 312; y++ {
+			line := d.line(b, y)
+			b.syntax.Highlight(y, line, d.fg)
+			d.searchMatches(line, e.lastSearch)
+			d.lineNumber(y + 1)
+			h.reset(screen.seed)
+			e.hashTextRow(&h, b, y, d.cursors[:1])
+			screen.rowChanged(y-290, h.sum())
+		}
+	}
+	steadyAllocs(t, "drawing a row", row)
+
+	status := func() {
+		d.fileStatus(b)
+		d.positionStatus(b.fileType, 1, 1, 302, 5, 75)
+		d.diagSummary(b, 20)
+	}
+	steadyAllocs(t, "formatting the status bar", status)
+
+	if got := string(d.line(b, 1)); got != "    return x + 0  # line é😀 0" {
+		t.Errorf("line(1) = %q", got)
+	}
+	if got := string(d.positionStatus(b.fileType, 1, 2, 302, 5, 75)); got != "(python) [1/2] 302,5 75% " {
+		t.Errorf("positionStatus = %q", got)
+	}
+	if got := string(d.diagSummary(b, 20)); got != "1 error(s): undef..." {
+		t.Errorf("diagSummary = %q", got)
+	}
+}
+
+// BenchmarkDraw measures a steady-state frame: the cursor moves between two
+// rows far apart, so the view scrolls and every text row is repainted, with
+// highlighting, diagnostics, a search and several cursors on screen. It fails
+// if such a frame, or an idle one, allocates. termbox needs a terminal, so it
+// is skipped without one; TestDrawScratchAllocs covers the parts of a frame
+// that do not draw.
+func BenchmarkDraw(b *testing.B) {
+	if err := termbox.Init(); err != nil {
+		b.Skip("no terminal:", err)
+	}
+	defer termbox.Close()
+	termbox.SetOutputMode(termbox.Output256)
+
+	e := newDrawEditor(b)
+	buf := e.activeBuffer()
+	y := 0
+	frame := func() {
+		y = 300 - y
+		buf.PrimaryCursor().Y = y
+		e.draw()
+	}
+	steadyAllocs(b, "scrolling frame", frame)
+	steadyAllocs(b, "idle frame", e.draw)
+
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		frame()
+	}
+}
@@ -0,0 +1,141 @@
+package main
+
+// Diagnostics of a buffer indexed by line. The index is built once when the
+// server publishes new diagnostics, so drawing a row looks up its gutter sign
+// and underlines directly instead of scanning every diagnostic.
+
+import (
+	"slices"
+	"sync/atomic"
+)
+
+// diagnosticsVersion numbers the sets of diagnostics published by all
+// servers, so a buffer can tell whether the set it indexed is still current.
+var diagnosticsVersion int64
+
+// diagnosticSpan is the part of a diagnostic's range that lies on one line,
+// as rune columns [start, end).
+type diagnosticSpan struct {
+	start    int
+	end      int
+	severity int
+}
+
+// lineDiagnostics are the diagnostics touching one line.
+type lineDiagnostics struct {
+	severity int              // Most severe diagnostic starting on the line, 0 if none.
+	spans    []diagnosticSpan // Ranges on the line to underline, by start.
+}
+
+// diagnosticIndex holds the diagnostics of a buffer by line.
+type diagnosticIndex struct {
+	lines  []lineDiagnostics // Indexed by line number, up to the last line with a diagnostic.
+	errors int               // Number of diagnostics with error severity.
+}
+
+// at returns the diagnostics of line y, or nil if there are none.
+func (x *diagnosticIndex) at(y int) *lineDiagnostics {
+	if y < 0 || y >= len(x.lines) {
+		return nil
+	}
+	return &x.lines[y]
+}
+
+// moreSevere reports whether severity a outranks b. 1 is an error and 4 a
+// hint; 0 means no severity.
+func moreSevere(a, b int) bool {
+	return a > 0 && (b == 0 || a < b)
+}
+
+// newDiagnosticIndex indexes diags, whose positions are counted in the code
+// units of enc, against the lines of b. Diagnostics past the end of the
+// buffer are clamped to its last line.
+func newDiagnosticIndex(diags []Diagnostic, b *Buffer, enc positionEncoding) diagnosticIndex {
+	var x diagnosticIndex
+	last := b.lineCount() - 1
+	if len(diags) == 0 || last < 0 {
+		return x
+	}
+
+	for _, d := range diags {
+		if d.Severity == 1 {
+			x.errors++
+		}
+		startY := min(max(d.Range.Start.Line, 0), last)
+		endY := min(max(d.Range.End.Line, startY), last)
+		if endY >= len(x.lines) {
+			x.lines = append(x.lines, make([]lineDiagnostics, endY+1-len(x.lines))...)
+		}
+
+		if moreSevere(d.Severity, x.lines[startY].severity) {
+			x.lines[startY].severity = d.Severity
+		}
+
+		for y := startY; y <= endY; y++ {
+			span := diagnosticSpan{start: 0, end: b.lineLen(y), severity: d.Severity}
+			if y == startY {
+				span.start = b.lspColumn(enc, y, d.Range.Start.Character)
+			}
+			if y == d.Range.End.Line {
+				span.end = b.lspColumn(enc, y, d.Range.End.Character)
+			}
+			// Empty ranges still mark the character they point at.
+			if span.end <= span.start {
+				span.end = span.start + 1
+			}
+			x.lines[y].spans = append(x.lines[y].spans, span)
+		}
+	}
+
+	for _, l := range x.lines {
+		slices.SortFunc(l.spans, func(a, b diagnosticSpan) int {
+			return a.start - b.start
+		})
+	}
+	return x
+}
+
+// underlines walks the spans of a line while its row is drawn, see covers.
+type underlines struct {
+	spans []diagnosticSpan // Spans not reached yet.
+	end   int              // End of the spans reached so far.
+}
+
+// underlines returns the walker for the spans of l, which may be nil.
+func (l *lineDiagnostics) underlines() underlines {
+	if l == nil {
+		return underlines{}
+	}
+	return underlines{spans: l.spans}
+}
+
+// covers reports whether rune column col is inside a span. Columns must be
+// passed in increasing order, so a row costs O(width + spans).
+func (u *underlines) covers(col int) bool {
+	for len(u.spans) > 0 && u.spans[0].start <= col {
+		u.end = max(u.end, u.spans[0].end)
+		u.spans = u.spans[1:]
+	}
+	return col < u.end
+}
+
+// refreshDiagnostics takes the latest diagnostics from the LSP client and
+// indexes them if they changed since the last call.
+func (b *Buffer) refreshDiagnostics() {
+	if b.lspClient == nil {
+		return
+	}
+	diags, version := b.lspClient.Diagnostics()
+	if version == b.diagVersion {
+		return
+	}
+	b.diagnostics = diags
+	b.diagVersion = version
+	b.diagIndex = newDiagnosticIndex(diags, b, b.lspClient.Encoding())
+}
+
+// nextDiagnosticsVersion returns the version for a newly published set of
+// diagnostics.
+func nextDiagnosticsVersion() int64 {
+	return atomic.AddInt64(&diagnosticsVersion, 1)
+}
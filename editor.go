@@ -6,14 +6,15 @@ package main
 
 import (
 	"bufio"
+	"context"
 	"fmt"
 	"io"
 	"os"
 	"os/exec"
 	"path/filepath"
 	"runtime"
+	"slices"
 	"sort"
-	"strconv"
 	"strings"
 	"time"
 	"unicode"
@@ -84,16 +85,17 @@ type Editor struct {
 	fuzzyBuffer        []rune           // Filter pattern in fuzzy finder.
 	fuzzyResults       []string         // Filtered items shown to the user.
 	fuzzyResultIndices []int            // Map from displayed results back to original candidates.
+	fuzzyScores        []int            // Match score of each result, see addFuzzyCandidates.
 	fuzzyIndex         int              // Highlighted item in the result list.
 	fuzzyScroll        int              // Viewport offset for the result list.
 	fuzzyCandidates    []string         // Raw list of all possible items (files/buffers/etc.).
 	fuzzyType          FuzzyType        // What the fuzzy finder is searching for.
 	fuzzyDiagnostics   []DiagnosticItem // Diagnostics from all buffers (accessible via finder).
+	stopFileWalk       func()           // Cancels the walk feeding the file finder, nil if none runs.
 	mouseEnabled       bool             // Toggle for mouse support.
 	visualStartX       int              // Starting anchor for visual selection.
 	visualStartY       int              // Starting anchor for visual selection.
-	logMessages        []string         // Internal debug logs shown in the Log window.
-	maxLogMessages     int              // Maximum capacity of the log ring buffer.
+	log                *logger          // Internal debug logs shown in the Log window.
 	showDebugLog       bool             // Visibility toggle for the log window.
 	jumplist           []Jump           // History of cursor locations (for Ctrl-O/Ctrl-I).
 	jumpIndex          int              // Current position in the jumplist.
@@ -102,6 +104,7 @@ type Editor struct {
 	devMode            bool             // Internal developer mode toggle.
 	ollamaClient       *OllamaClient    // Client for local AI features.
 	introDismissed     bool             // Whether the splash screen was hidden.
+	results            chan func()      // Work from other goroutines waiting to be applied by the event loop.
 
 	// Replace mode state (regex replacement UI)
 	replaceInput     []rune
@@ -119,6 +122,9 @@ type Editor struct {
 	autocompleteItems  []CompletionItem // List of completion suggestions from LSP.
 	autocompleteIndex  int              // Currently selected item in the autocomplete list.
 	autocompleteScroll int              // Scroll offset for autocomplete popup.
+	screen             screenState      // What the last frame drew, see draw.
+	scratch            drawScratch      // Buffers reused by draw.
+	completion         completionCache  // Last completion list from LSP, see triggerAutocomplete.
 }
 
 // activeBuffer returns the Buffer currently being edited.
@@ -137,10 +143,16 @@ func (e *Editor) useTabs() bool {
 	return b.fileType.UseTabs
 }
 
+// markModified is called after every edit of the active buffer. It hands
+// the new text to the LSP client, so requests never see stale text.
 func (e *Editor) markModified() {
 	b := e.activeBuffer()
 	if b != nil {
 		b.modified = true
+		b.syncLSP()
+		if e.completion.buffer != nil && !e.inCompletionWord(b) {
+			e.completion = completionCache{}
+		}
 	}
 }
 
@@ -165,17 +177,6 @@ func (e *Editor) bufferToVisual(line []rune, bufferX int) int {
 	return visualX
 }
 
-func (e *Editor) bufferToString(buffer [][]rune) string {
-	var result strings.Builder
-	for i, line := range buffer {
-		result.WriteString(string(line))
-		if i < len(buffer)-1 {
-			result.WriteString("\n")
-		}
-	}
-	return result.String()
-}
-
 // NewEditor creates a new editor instance with a default empty buffer.
 func NewEditor(devMode bool) *Editor {
 	e := &Editor{
@@ -194,19 +195,19 @@ func NewEditor(devMode bool) *Editor {
 		fuzzyScroll:       0,
 		fuzzyCandidates:   []string{},
 		mouseEnabled:      true,
-		logMessages:       []string{},
-		maxLogMessages:    50,
+		log:               newLogger(50, logFilePath()),
 		showDebugLog:      false,
 		jumplist:          []Jump{},
 		jumpIndex:         -1,
 		devMode:           devMode,
 		ollamaClient:      NewOllamaClient(),
+		results:           make(chan func(), 16),
 	}
 	e.addLog("Editor", "Editor initialized")
 	// Add an initial empty buffer with default file type
 	defaultType := fileTypes[len(fileTypes)-1]
 	e.buffers = append(e.buffers, &Buffer{
-		buffer:    [][]rune{{}},
+		text:      newRope([]string{""}),
 		undoStack: []HistoryState{},
 		redoStack: []HistoryState{},
 		fileType:  defaultType,
@@ -218,20 +219,15 @@ func NewEditor(devMode bool) *Editor {
 func (e *Editor) addLog(group, msg string) {
 	t := time.Now()
 	timestamp := fmt.Sprintf("[%02d:%01d:%02d]", t.Hour(), t.Minute(), t.Second())
-	logMsg := fmt.Sprintf("%s [%s] %s", timestamp, group, msg)
-	e.logMessages = append(e.logMessages, logMsg)
-
-	if len(e.logMessages) > e.maxLogMessages {
-		e.logMessages = e.logMessages[len(e.logMessages)-e.maxLogMessages:]
-	}
+	e.log.add(fmt.Sprintf("%s [%s] %s", timestamp, group, msg))
+}
 
-	if Config.UseLogFile {
-		f, err := os.OpenFile(Config.LogFilePath, os.O_APPEND|os.O_CREATE|os.O_WRONLY, 0644)
-		if err == nil {
-			defer f.Close()
-			f.WriteString(logMsg + "\n")
-		}
+// logFilePath returns where the debug log is written, or "" without -log.
+func logFilePath() string {
+	if !Config.UseLogFile {
+		return ""
 	}
+	return Config.LogFilePath
 }
 
 func (e *Editor) toggleDebugWindow() {
@@ -244,7 +240,7 @@ func (e *Editor) NewBuffer() {
 	defaultType := fileTypes[len(fileTypes)-1]
 
 	newB := &Buffer{
-		buffer:    [][]rune{{}},
+		text:      newRope([]string{""}),
 		filename:  "",
 		undoStack: []HistoryState{},
 		redoStack: []HistoryState{},
@@ -299,7 +295,7 @@ func (e *Editor) LoadFile(filename string) error {
 func (e *Editor) LoadFromReader(filename string, r io.Reader) error {
 	ft := getFileType(filename)
 
-	var bufferLines [][]rune
+	var bufferLines []string
 	reader := bufio.NewReader(r)
 	for {
 		line, err := reader.ReadString('\n')
@@ -318,7 +314,7 @@ func (e *Editor) LoadFromReader(filename string, r io.Reader) error {
 		if !ft.UseTabs {
 			trimmedLine = strings.ReplaceAll(trimmedLine, "\t", strings.Repeat(" ", ft.TabWidth))
 		}
-		bufferLines = append(bufferLines, []rune(trimmedLine))
+		bufferLines = append(bufferLines, validUTF8(trimmedLine))
 
 		if err == io.EOF {
 			break
@@ -327,37 +323,33 @@ func (e *Editor) LoadFromReader(filename string, r io.Reader) error {
 
 	// Ensure buffer is never empty
 	if len(bufferLines) == 0 {
-		bufferLines = [][]rune{{}}
+		bufferLines = []string{""}
 	}
 
 	// Check if we should update current buffer or add a new one
 	b := e.activeBuffer()
-	if b != nil && b.filename == "" && len(b.buffer) == 1 && len(b.buffer[0]) == 0 {
+	if b != nil && b.filename == "" && b.lineCount() == 1 && b.lineLen(0) == 0 {
 		// reuse current empty buffer
 		b.filename = filename
-		b.buffer = bufferLines
+		b.setLines(bufferLines)
 		b.PrimaryCursor().X = 0
 		b.PrimaryCursor().Y = 0
 		b.scrollX = 0
 		b.scrollY = 0
-		b.undoStack = []HistoryState{}
-		b.redoStack = []HistoryState{}
-		b.redoStack = []HistoryState{}
+		b.clearHistory()
 		b.fileType = ft
 
 		// Initialize Syntax Highlighter
 		syntax := NewSyntaxHighlighter(ft.Name, e.addLog)
 		if syntax != nil {
-			content := e.bufferToString(bufferLines)
-			syntax.Parse([]byte(content))
+			syntax.Parse(b.snapshot())
 			b.syntax = syntax
 		}
 
 		// Initialize LSP if enabled for this file type
 		if ft.EnableLSP && ft.LSPCommand != "" {
 			e.addLog("LSP", fmt.Sprintf("Starting LSP for %s", filepath.Base(filename)))
-			content := e.bufferToString(bufferLines)
-			lspClient, err := NewLSPClient(filename, content, e.addLog, ft)
+			lspClient, err := NewLSPClient(filename, b.snapshot(), e.addLog, ft)
 			if err == nil {
 				b.lspClient = lspClient
 				e.addLog("LSP", "LSP client initialized successfully")
@@ -368,7 +360,7 @@ func (e *Editor) LoadFromReader(filename string, r io.Reader) error {
 	} else {
 		// add new buffer
 		newB := &Buffer{
-			buffer:    bufferLines,
+			text:      newRope(bufferLines),
 			filename:  filename,
 			undoStack: []HistoryState{},
 			redoStack: []HistoryState{},
@@ -378,16 +370,14 @@ func (e *Editor) LoadFromReader(filename string, r io.Reader) error {
 		// Initialize Syntax Highlighter
 		syntax := NewSyntaxHighlighter(ft.Name, e.addLog)
 		if syntax != nil {
-			content := e.bufferToString(bufferLines)
-			syntax.Parse([]byte(content))
+			syntax.Parse(newB.snapshot())
 			newB.syntax = syntax
 		}
 
 		// Initialize LSP if enabled for this file type
 		if ft.EnableLSP && ft.LSPCommand != "" {
 			e.addLog("LSP", fmt.Sprintf("Starting LSP for %s", filepath.Base(filename)))
-			content := e.bufferToString(bufferLines)
-			lspClient, err := NewLSPClient(filename, content, e.addLog, ft)
+			lspClient, err := NewLSPClient(filename, newB.snapshot(), e.addLog, ft)
 			if err == nil {
 				newB.lspClient = lspClient
 				e.addLog("LSP", "LSP client initialized successfully")
@@ -426,13 +416,13 @@ func (e *Editor) SaveFile(force bool) error {
 	defer file.Close()
 
 	writer := bufio.NewWriter(file)
-	for i, line := range b.buffer {
-		_, err := writer.WriteString(string(line))
+	for i := 0; i < b.lineCount(); i++ {
+		_, err := writer.WriteString(b.lineString(i))
 		if err != nil {
 			return err
 		}
 		// Write newline if not the last line (or if buffer should end with newline).
-		if i < len(b.buffer)-1 || (len(b.buffer) > 0 && (len(b.buffer) > 1 || len(b.buffer[0]) > 0)) {
+		if i < b.lineCount()-1 || (b.lineCount() > 0 && (b.lineCount() > 1 || b.lineLen(0) > 0)) {
 			_, err = writer.WriteString("\n")
 			if err != nil {
 				return err
@@ -480,7 +470,7 @@ func (e *Editor) ReloadBuffer(b *Buffer) error {
 
 	ft := getFileType(b.filename)
 
-	var bufferLines [][]rune
+	var bufferLines []string
 	reader := bufio.NewReader(file)
 	for {
 		line, err := reader.ReadString('\n')
@@ -498,7 +488,7 @@ func (e *Editor) ReloadBuffer(b *Buffer) error {
 		if !ft.UseTabs {
 			trimmedLine = strings.ReplaceAll(trimmedLine, "\t", strings.Repeat(" ", ft.TabWidth))
 		}
-		bufferLines = append(bufferLines, []rune(trimmedLine))
+		bufferLines = append(bufferLines, validUTF8(trimmedLine))
 
 		if err == io.EOF {
 			break
@@ -506,42 +496,43 @@ func (e *Editor) ReloadBuffer(b *Buffer) error {
 	}
 
 	if len(bufferLines) == 0 {
-		bufferLines = [][]rune{{}}
+		bufferLines = []string{""}
 	}
 
-	b.buffer = bufferLines
+	// The undo history holds changes to the old text, which would corrupt
+	// the new one if undone.
+	b.setLines(bufferLines)
+	b.clearHistory()
 	b.lastModTime = info.ModTime()
 	b.modified = false
 
 	// Adjust cursors if they are out of bounds
 	for i := range b.cursors {
 		c := &b.cursors[i]
-		if c.Y >= len(b.buffer) {
-			c.Y = len(b.buffer) - 1
+		if c.Y >= b.lineCount() {
+			c.Y = b.lineCount() - 1
 		}
 		if c.Y < 0 {
 			c.Y = 0
 		}
-		if c.X > len(b.buffer[c.Y]) {
-			c.X = len(b.buffer[c.Y])
+		if c.X > b.lineLen(c.Y) {
+			c.X = b.lineLen(c.Y)
 		}
 	}
 
 	// Reinitialize Syntax Highlighter
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Parse(b.snapshot())
 	} else {
 		syntax := NewSyntaxHighlighter(ft.Name, e.addLog)
 		if syntax != nil {
-			syntax.Parse([]byte(b.toString()))
+			syntax.Parse(b.snapshot())
 			b.syntax = syntax
 		}
 	}
 
 	// Update LSP if active
-	if b.lspClient != nil {
-		b.lspClient.SendDidChange(b.toString())
-	}
+	b.syncLSP()
 
 	return nil
 }
@@ -582,30 +573,34 @@ func (e *Editor) CheckFilesOnDisk() {
 	}
 }
 
+// PeriodicFileChangesCheck checks the open files for changes on disk every
+// Config.FileCheckInterval. The check runs on the event loop, since it
+// reloads buffers, but only this often rather than on every interrupt.
 func (e *Editor) PeriodicFileChangesCheck() {
 	go func() {
 		for {
 			time.Sleep(Config.FileCheckInterval)
-			termbox.Interrupt()
+			e.postResult(e.CheckFilesOnDisk)
 		}
 	}()
 }
 
+// startFileFuzzyFinder opens the finder on the files under the working
+// directory. The files are found by a walk in the background and show up as
+// they are found.
 func (e *Editor) startFileFuzzyFinder() {
-	e.fuzzyCandidates = []string{}
-	filepath.Walk(".", func(path string, info os.FileInfo, err error) error {
-		if err != nil {
-			return nil
-		}
-		if info.IsDir() {
-			if info.Name() == ".git" || info.Name() == "node_modules" {
-				return filepath.SkipDir
+	e.cancelFileWalk()
+	ctx, cancel := context.WithCancel(context.Background())
+	e.stopFileWalk = cancel
+	go walkFiles(ctx, ".", Config.FuzzyExclude, func(paths []string) {
+		e.postResult(func() {
+			if ctx.Err() == nil {
+				e.addFuzzyCandidates(paths)
 			}
-			return nil
-		}
-		e.fuzzyCandidates = append(e.fuzzyCandidates, path)
-		return nil
+		})
 	})
+
+	e.fuzzyCandidates = []string{}
 	e.fuzzyBuffer = []rune{}
 	e.fuzzyIndex = 0
 	e.fuzzyType = FuzzyModeFile
@@ -741,42 +736,115 @@ func fuzzyMatch(query, target string) (int, bool) {
 }
 
 func (e *Editor) updateFuzzyResults() {
+	e.fuzzyResults, e.fuzzyResultIndices, e.fuzzyScores = e.filterFuzzyCandidates(0)
+	if e.fuzzyIndex >= len(e.fuzzyResults) {
+		e.fuzzyIndex = 0
+	}
+	e.fuzzyScroll = 0
+}
+
+// filterFuzzyCandidates matches the candidates from index start on against
+// the query and returns the matches, their candidate indices and scores, best
+// first. Files with equal scores are ordered by path, see fileResultBefore;
+// other matches with equal scores keep the order of the candidates.
+func (e *Editor) filterFuzzyCandidates(start int) ([]string, []int, []int) {
 	query := string(e.fuzzyBuffer)
-	if query == "" {
-		e.fuzzyResults = make([]string, len(e.fuzzyCandidates))
-		e.fuzzyResultIndices = make([]int, len(e.fuzzyCandidates))
-		copy(e.fuzzyResults, e.fuzzyCandidates)
-		for i := range e.fuzzyResultIndices {
-			e.fuzzyResultIndices[i] = i
-		}
-	} else {
-		type result struct {
-			path  string
-			index int
-			score int
-		}
-		var results []result
-		for i, candidate := range e.fuzzyCandidates {
-			if score, ok := fuzzyMatch(query, candidate); ok {
-				results = append(results, result{candidate, i, score})
-			}
+	type result struct {
+		path  string
+		index int
+		score int
+	}
+	var results []result
+	for i := start; i < len(e.fuzzyCandidates); i++ {
+		if score, ok := fuzzyMatch(query, e.fuzzyCandidates[i]); ok {
+			results = append(results, result{e.fuzzyCandidates[i], i, score})
 		}
+	}
 
+	if e.fuzzyType == FuzzyModeFile {
 		sort.Slice(results, func(i, j int) bool {
+			return fileResultBefore(results[i].score, results[i].path, results[j].score, results[j].path)
+		})
+	} else if query != "" {
+		sort.SliceStable(results, func(i, j int) bool {
 			return results[i].score > results[j].score
 		})
+	}
+
+	paths := make([]string, len(results))
+	indices := make([]int, len(results))
+	scores := make([]int, len(results))
+	for i, res := range results {
+		paths[i] = res.path
+		indices[i] = res.index
+		scores[i] = res.score
+	}
+	return paths, indices, scores
+}
+
+// fileResultBefore reports whether a file with score scoreA and path pathA is
+// listed before one with scoreB and pathB: better scores first, then by
+// pathLess, so the order does not depend on when the walk found the files.
+func fileResultBefore(scoreA int, pathA string, scoreB int, pathB string) bool {
+	if scoreA != scoreB {
+		return scoreA > scoreB
+	}
+	return pathLess(pathA, pathB)
+}
+
+// addFuzzyCandidates adds paths found by the file walk to the finder. Only
+// the new paths are matched against the query, and their matches are merged
+// into the results, see fileResultBefore. The highlighted result stays
+// highlighted.
+func (e *Editor) addFuzzyCandidates(paths []string) {
+	if e.mode != ModeFuzzy || e.fuzzyType != FuzzyModeFile {
+		return
+	}
+	start := len(e.fuzzyCandidates)
+	e.fuzzyCandidates = append(e.fuzzyCandidates, paths...)
+	newPaths, newIndices, newScores := e.filterFuzzyCandidates(start)
+	if len(newPaths) == 0 {
+		return
+	}
 
-		e.fuzzyResults = make([]string, len(results))
-		e.fuzzyResultIndices = make([]int, len(results))
-		for i, res := range results {
-			e.fuzzyResults[i] = res.path
-			e.fuzzyResultIndices[i] = res.index
+	n := len(e.fuzzyResults) + len(newPaths)
+	results := make([]string, 0, n)
+	indices := make([]int, 0, n)
+	scores := make([]int, 0, n)
+	selected := e.fuzzyIndex
+	i, j := 0, 0
+	for i < len(e.fuzzyResults) || j < len(newPaths) {
+		if j == len(newPaths) || i < len(e.fuzzyResults) && !fileResultBefore(newScores[j], newPaths[j], e.fuzzyScores[i], e.fuzzyResults[i]) {
+			if i == e.fuzzyIndex {
+				selected = len(results)
+			}
+			results = append(results, e.fuzzyResults[i])
+			indices = append(indices, e.fuzzyResultIndices[i])
+			scores = append(scores, e.fuzzyScores[i])
+			i++
+		} else {
+			results = append(results, newPaths[j])
+			indices = append(indices, newIndices[j])
+			scores = append(scores, newScores[j])
+			j++
 		}
 	}
-	if e.fuzzyIndex >= len(e.fuzzyResults) {
-		e.fuzzyIndex = 0
+	e.fuzzyResults, e.fuzzyResultIndices, e.fuzzyScores = results, indices, scores
+	e.fuzzyIndex = selected
+
+	if e.fuzzyIndex < e.fuzzyScroll {
+		e.fuzzyScroll = e.fuzzyIndex
+	} else if e.fuzzyIndex >= e.fuzzyScroll+Config.FuzzyFinderHeight {
+		e.fuzzyScroll = e.fuzzyIndex - Config.FuzzyFinderHeight + 1
+	}
+}
+
+// cancelFileWalk stops the walk started by startFileFuzzyFinder, if any.
+func (e *Editor) cancelFileWalk() {
+	if e.stopFileWalk != nil {
+		e.stopFileWalk()
+		e.stopFileWalk = nil
 	}
-	e.fuzzyScroll = 0
 }
 
 func (e *Editor) openSelectedFile() {
@@ -839,9 +907,9 @@ func (e *Editor) openSelectedFile() {
 			b := e.activeBuffer()
 			if b != nil {
 				// Set cursor to diagnostic line and character
-				if diagItem.line < len(b.buffer) {
+				if diagItem.line < b.lineCount() {
 					b.PrimaryCursor().Y = diagItem.line
-					if diagItem.character < len(b.buffer[diagItem.line]) {
+					if diagItem.character < b.lineLen(diagItem.line) {
 						b.PrimaryCursor().X = diagItem.character
 					} else {
 						b.PrimaryCursor().X = 0
@@ -933,30 +1001,25 @@ func (e *Editor) insertRune(r rune) {
 
 	cursors := e.getSortedCursorsDesc()
 	for _, c := range cursors {
-		line := b.buffer[c.Y]
+		line := b.line(c.Y)
 		newLine := make([]rune, len(line)+1)
 		copy(newLine[:c.X], line[:c.X])
 		newLine[c.X] = r
 		copy(newLine[c.X+1:], line[c.X:])
-		b.buffer[c.Y] = newLine
+		b.setLine(c.Y, newLine)
 		c.X++
 
 		// Handle syntax update
 		if b.syntax != nil {
-			insertedBytes := uint32(len(string(r)))
+			insertedBytes := uint32(runeLen(r))
 			b.handleEdit(c.Y, c.X-1, 0, insertedBytes, c.Y, b.getLineByteOffset(line, c.X-1), c.Y, b.getLineByteOffset(newLine, c.X))
 		}
 	}
 
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 	e.markModified()
-
-	// Notify LSP of the change
-	if b.lspClient != nil {
-		b.lspClient.SendDidChange(b.toString())
-	}
 }
 
 // DeleteChar removes the character directly under the cursor.
@@ -972,19 +1035,24 @@ func (e *Editor) DeleteChar() {
 
 	cursors := e.getSortedCursorsDesc()
 	for _, c := range cursors {
-		if c.Y >= len(b.buffer) || c.X >= len(b.buffer[c.Y]) {
+		if c.Y >= b.lineCount() || c.X >= b.lineLen(c.Y) {
 			continue
 		}
 
-		line := b.buffer[c.Y]
+		line := b.line(c.Y)
 		// Store deleted character in clipboard (primary cursor only).
 		if c == b.PrimaryCursor() {
 			e.clipboard = []rune{line[c.X]}
 		}
 
-		deletedBytes := uint32(len(string(line[c.X])))
-		newLine := append(line[:c.X], line[c.X+1:]...)
-		b.buffer[c.Y] = newLine
+		deletedBytes := uint32(runeLen(line[c.X]))
+		newLine := append(line[:c.X:c.X], line[c.X+1:]...)
+		b.setLine(c.Y, newLine)
+
+		if b.syntax != nil {
+			colBytes := b.getLineByteOffset(newLine, c.X)
+			b.handleEdit(c.Y, c.X, deletedBytes, 0, c.Y, colBytes+deletedBytes, c.Y, colBytes)
+		}
 
 		// Ensure cursor doesn't drift past the new end of line.
 		if c.X > 0 && c.X >= len(newLine) {
@@ -993,15 +1061,9 @@ func (e *Editor) DeleteChar() {
 				c.X = 0
 			}
 		}
-
-		if b.syntax != nil {
-			oldColBytes := b.getLineByteOffset(line, c.X)
-			newColBytes := b.getLineByteOffset(newLine, c.X)
-			b.handleEdit(c.Y, c.X, deletedBytes, 0, c.Y, oldColBytes+deletedBytes, c.Y, newColBytes)
-		}
 	}
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 	e.markModified()
 }
@@ -1019,25 +1081,23 @@ func (e *Editor) backspace() {
 	cursors := e.getSortedCursorsDesc()
 	for _, c := range cursors {
 		if c.X > 0 {
-			line := b.buffer[c.Y]
+			line := b.line(c.Y)
 			deletedChar := line[c.X-1]
-			newLine := append(line[:c.X-1], line[c.X:]...)
-			b.buffer[c.Y] = newLine
+			newLine := append(line[:c.X-1:c.X-1], line[c.X:]...)
+			b.setLine(c.Y, newLine)
 			c.X--
 
 			if b.syntax != nil {
-				deletedBytes := uint32(len(string(deletedChar)))
-				oldColBytes := b.getLineByteOffset(line, c.X+1)
-				newColBytes := b.getLineByteOffset(newLine, c.X)
-
-				b.handleEdit(c.Y, c.X, deletedBytes, 0, c.Y, oldColBytes, c.Y, newColBytes)
+				deletedBytes := uint32(runeLen(deletedChar))
+				colBytes := b.getLineByteOffset(newLine, c.X)
+				b.handleEdit(c.Y, c.X, deletedBytes, 0, c.Y, colBytes+deletedBytes, c.Y, colBytes)
 			}
 		} else if c.Y > 0 {
 			// Merge with previous line
-			prevLine := b.buffer[c.Y-1]
+			prevLine := b.line(c.Y - 1)
 			c.X = len(prevLine)
-			b.buffer[c.Y-1] = append(prevLine, b.buffer[c.Y]...)
-			b.buffer = append(b.buffer[:c.Y], b.buffer[c.Y+1:]...)
+			b.setLine(c.Y-1, append(prevLine[:c.X:c.X], b.line(c.Y)...))
+			b.deleteLines(c.Y, c.Y+1)
 			// We need to shift cursors that are 'below' the current merge point.
 			for j := range b.cursors {
 				if b.cursors[j].Y > c.Y {
@@ -1058,12 +1118,12 @@ func (e *Editor) backspace() {
 			}
 
 			if b.syntax != nil {
-				b.handleEdit(c.Y, c.X, 1, 0, c.Y+1, 0, c.Y, b.getLineByteOffset(b.buffer[c.Y], c.X))
+				b.handleEdit(c.Y, c.X, 1, 0, c.Y+1, 0, c.Y, b.byteCol(c.Y, c.X))
 			}
 		}
 	}
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 	e.markModified()
 }
@@ -1093,7 +1153,7 @@ func (e *Editor) insertNewline() {
 
 	cursors := e.getSortedCursorsDesc()
 	for _, c := range cursors {
-		line := b.buffer[c.Y]
+		line := b.line(c.Y)
 
 		// Inherit indentation from the current line.
 		indent := e.getIndentation(line[:c.X])
@@ -1115,14 +1175,10 @@ func (e *Editor) insertNewline() {
 		copy(remaining, line[c.X:])
 
 		newLine := append(indent, remaining...)
-		b.buffer[c.Y] = line[:c.X]
+		b.setLine(c.Y, line[:c.X:c.X])
 
 		// Insert the new line into the buffer.
-		newBuffer := make([][]rune, len(b.buffer)+1)
-		copy(newBuffer[:c.Y+1], b.buffer[:c.Y+1])
-		newBuffer[c.Y+1] = newLine
-		copy(newBuffer[c.Y+2:], b.buffer[c.Y+1:])
-		b.buffer = newBuffer
+		b.insertLines(c.Y+1, newLine)
 
 		// Shift all cursors below this point, or later on this same line.
 		for j := range b.cursors {
@@ -1139,12 +1195,12 @@ func (e *Editor) insertNewline() {
 		c.X = len(indent)
 
 		if b.syntax != nil {
-			insertedBytes := uint32(1 + len(string(indent)))
-			b.handleEdit(c.Y-1, oldCursorX, 0, insertedBytes, c.Y-1, b.getLineByteOffset(b.buffer[c.Y-1], oldCursorX), c.Y, b.getLineByteOffset(b.buffer[c.Y], c.X))
+			insertedBytes := 1 + byteLen(indent)
+			b.handleEdit(c.Y-1, oldCursorX, 0, insertedBytes, c.Y-1, b.byteCol(c.Y-1, oldCursorX), c.Y, b.byteCol(c.Y, c.X))
 		}
 	}
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 	e.markModified()
 }
@@ -1158,11 +1214,11 @@ func (e *Editor) insertLineBelow() {
 		e.message = "File is read-only"
 		return
 	}
-	line := b.buffer[b.PrimaryCursor().Y]
+	line := b.line(b.PrimaryCursor().Y)
 	indent := e.getIndentation(line)
 
 	// Check if the current line ends with '{' to increase indent
-	trimmedLine := strings.TrimRight(string(line), " ")
+	trimmedLine := strings.TrimRight(b.lineString(b.PrimaryCursor().Y), " ")
 	if len(trimmedLine) > 0 && trimmedLine[len(trimmedLine)-1] == '{' {
 		if e.useTabs() {
 			indent = append(indent, '\t')
@@ -1175,24 +1231,20 @@ func (e *Editor) insertLineBelow() {
 		}
 	}
 
-	newBuffer := make([][]rune, len(b.buffer)+1)
-	copy(newBuffer[:b.PrimaryCursor().Y+1], b.buffer[:b.PrimaryCursor().Y+1])
-	newBuffer[b.PrimaryCursor().Y+1] = indent
-	copy(newBuffer[b.PrimaryCursor().Y+2:], b.buffer[b.PrimaryCursor().Y+1:])
-	b.buffer = newBuffer
+	b.insertLines(b.PrimaryCursor().Y+1, indent)
 
 	b.PrimaryCursor().Y++
 	b.PrimaryCursor().X = len(indent)
 
 	if b.syntax != nil {
-		insertedBytes := uint32(1 + len(string(indent)))
+		insertedBytes := 1 + byteLen(indent)
 		oldLineLen := b.getLineByteOffset(line, len(line))
-		b.handleEdit(b.PrimaryCursor().Y-1, len(line), 0, insertedBytes, b.PrimaryCursor().Y-1, oldLineLen, b.PrimaryCursor().Y, b.getLineByteOffset(b.buffer[b.PrimaryCursor().Y], b.PrimaryCursor().X))
+		b.handleEdit(b.PrimaryCursor().Y-1, len(line), 0, insertedBytes, b.PrimaryCursor().Y-1, oldLineLen, b.PrimaryCursor().Y, b.byteCol(b.PrimaryCursor().Y, b.PrimaryCursor().X))
 	}
 
 	e.mode = ModeInsert
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 	e.markModified()
 }
@@ -1206,25 +1258,21 @@ func (e *Editor) insertLineAbove() {
 		e.message = "File is read-only"
 		return
 	}
-	line := b.buffer[b.PrimaryCursor().Y]
+	line := b.line(b.PrimaryCursor().Y)
 	indent := e.getIndentation(line)
 
-	newBuffer := make([][]rune, len(b.buffer)+1)
-	copy(newBuffer[:b.PrimaryCursor().Y], b.buffer[:b.PrimaryCursor().Y])
-	newBuffer[b.PrimaryCursor().Y] = indent
-	copy(newBuffer[b.PrimaryCursor().Y+1:], b.buffer[b.PrimaryCursor().Y:])
-	b.buffer = newBuffer
+	b.insertLines(b.PrimaryCursor().Y, indent)
 
 	b.PrimaryCursor().X = len(indent)
 
 	if b.syntax != nil {
-		insertedBytes := uint32(1 + len(string(indent)))
+		insertedBytes := 1 + byteLen(indent)
 		b.handleEdit(b.PrimaryCursor().Y, 0, 0, insertedBytes, b.PrimaryCursor().Y, 0, b.PrimaryCursor().Y+1, 0)
 	}
 
 	e.mode = ModeInsert
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 	e.markModified()
 }
@@ -1239,12 +1287,12 @@ func (e *Editor) moveCursor(dx int, dy int) {
 		c := &b.cursors[i]
 		if dy != 0 {
 			newY := c.Y + dy
-			if newY >= 0 && newY < len(b.buffer) {
+			if newY >= 0 && newY < b.lineCount() {
 				c.Y = newY
 				// Snap cursorX to the end of the new line if it's currently further
 				// Or restore to preferred column if moving vertically
-				if c.PreferredCol > len(b.buffer[c.Y]) {
-					c.X = len(b.buffer[c.Y])
+				if c.PreferredCol > b.lineLen(c.Y) {
+					c.X = b.lineLen(c.Y)
 				} else {
 					c.X = c.PreferredCol
 				}
@@ -1256,10 +1304,10 @@ func (e *Editor) moveCursor(dx int, dy int) {
 			if newX < 0 {
 				if c.Y > 0 {
 					c.Y--
-					c.X = len(b.buffer[c.Y])
+					c.X = b.lineLen(c.Y)
 				}
-			} else if newX > len(b.buffer[c.Y]) {
-				if c.Y < len(b.buffer)-1 {
+			} else if newX > b.lineLen(c.Y) {
+				if c.Y < b.lineCount()-1 {
 					c.Y++
 					c.X = 0
 				}
@@ -1307,10 +1355,10 @@ func (e *Editor) isWordChar(r rune) bool {
 
 func (e *Editor) getWordUnderCursor() string {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return ""
 	}
-	line := b.buffer[b.PrimaryCursor().Y]
+	line := b.line(b.PrimaryCursor().Y)
 	if len(line) == 0 || b.PrimaryCursor().X >= len(line) {
 		return ""
 	}
@@ -1338,10 +1386,10 @@ func (e *Editor) isPathChar(r rune) bool {
 
 func (e *Editor) getPathUnderCursor() string {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return ""
 	}
-	line := b.buffer[b.PrimaryCursor().Y]
+	line := b.line(b.PrimaryCursor().Y)
 	if len(line) == 0 || b.PrimaryCursor().X >= len(line) {
 		return ""
 	}
@@ -1463,8 +1511,8 @@ func (e *Editor) centerCursor() {
 	}
 
 	// Clamp to legitimate buffer range.
-	if targetScrollY > len(b.buffer)-visibleHeight {
-		targetScrollY = len(b.buffer) - visibleHeight
+	if targetScrollY > b.lineCount()-visibleHeight {
+		targetScrollY = b.lineCount() - visibleHeight
 	}
 	if targetScrollY < 0 {
 		targetScrollY = 0
@@ -1473,15 +1521,29 @@ func (e *Editor) centerCursor() {
 	b.scrollY = targetScrollY
 }
 
+// gotoDefinition asks the LSP server for the definition of the symbol at the
+// cursor and jumps to it when the answer arrives.
 func (e *Editor) gotoDefinition() {
 	b := e.activeBuffer()
 	if b == nil || b.lspClient == nil {
 		return
 	}
 
-	e.pushJump()
+	cursor := *b.PrimaryCursor()
+	enc := b.lspClient.Encoding()
+	b.lspClient.Definition(b.lspPosition(enc, cursor.Y, cursor.X), func(locs []Location, err error) {
+		e.postResult(func() {
+			if e.cursorMoved(b, cursor) {
+				return
+			}
+			e.jumpToDefinition(locs, enc, err)
+		})
+	})
+}
 
-	locs, err := b.lspClient.Definition(b.PrimaryCursor().Y, b.PrimaryCursor().X)
+// jumpToDefinition opens the first of the definition locations, whose
+// positions are counted in the code units of enc.
+func (e *Editor) jumpToDefinition(locs []Location, enc positionEncoding, err error) {
 	if err != nil {
 		e.addLog("Editor", fmt.Sprintf("gotoDefinition error: %v", err))
 		return
@@ -1492,6 +1554,8 @@ func (e *Editor) gotoDefinition() {
 		return
 	}
 
+	e.pushJump()
+
 	loc := locs[0]
 	targetPath := strings.TrimPrefix(loc.URI, "file://")
 
@@ -1514,23 +1578,17 @@ func (e *Editor) gotoDefinition() {
 		}
 	}
 
-	b = e.activeBuffer()
+	b := e.activeBuffer()
 	b.PrimaryCursor().Y = loc.Range.Start.Line
-	b.PrimaryCursor().X = loc.Range.Start.Character
 
 	// Ensure cursor is within bounds
 	if b.PrimaryCursor().Y < 0 {
 		b.PrimaryCursor().Y = 0
 	}
-	if b.PrimaryCursor().Y >= len(b.buffer) {
-		b.PrimaryCursor().Y = len(b.buffer) - 1
-	}
-	if b.PrimaryCursor().X < 0 {
-		b.PrimaryCursor().X = 0
-	}
-	if b.PrimaryCursor().X > len(b.buffer[b.PrimaryCursor().Y]) {
-		b.PrimaryCursor().X = len(b.buffer[b.PrimaryCursor().Y])
+	if b.PrimaryCursor().Y >= b.lineCount() {
+		b.PrimaryCursor().Y = b.lineCount() - 1
 	}
+	b.PrimaryCursor().X = b.lspColumn(enc, b.PrimaryCursor().Y, loc.Range.Start.Character)
 	e.centerCursor()
 }
 
@@ -1634,21 +1692,21 @@ func (e *Editor) performJump(jump Jump) {
 	if b.PrimaryCursor().Y < 0 {
 		b.PrimaryCursor().Y = 0
 	}
-	if b.PrimaryCursor().Y >= len(b.buffer) {
-		b.PrimaryCursor().Y = len(b.buffer) - 1
+	if b.PrimaryCursor().Y >= b.lineCount() {
+		b.PrimaryCursor().Y = b.lineCount() - 1
 	}
 	if b.PrimaryCursor().X < 0 {
 		b.PrimaryCursor().X = 0
 	}
-	if b.PrimaryCursor().X > len(b.buffer[b.PrimaryCursor().Y]) {
-		b.PrimaryCursor().X = len(b.buffer[b.PrimaryCursor().Y])
+	if b.PrimaryCursor().X > b.lineLen(b.PrimaryCursor().Y) {
+		b.PrimaryCursor().X = b.lineLen(b.PrimaryCursor().Y)
 	}
 }
 
 // deleteWord removes a word-clump from the current cursor position.
 func (e *Editor) deleteWord(includeSpaces bool) {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
 	if b.readOnly {
@@ -1658,10 +1716,10 @@ func (e *Editor) deleteWord(includeSpaces bool) {
 
 	cursors := e.getSortedCursorsDesc()
 	for _, c := range cursors {
-		if c.Y >= len(b.buffer) {
+		if c.Y >= b.lineCount() {
 			continue
 		}
-		line := b.buffer[c.Y]
+		line := b.line(c.Y)
 		if len(line) == 0 || c.X >= len(line) {
 			continue
 		}
@@ -1704,12 +1762,13 @@ func (e *Editor) deleteWord(includeSpaces bool) {
 		}
 
 		// Delete from start to end
-		newLine := append(line[:start], line[end:]...)
-		b.buffer[c.Y] = newLine
+		deletedBytes := byteLen(line[start:end])
+		newLine := append(line[:start:start], line[end:]...)
+		b.setLine(c.Y, newLine)
 
 		// Ensure cursor is within bounds
-		if c.X >= len(b.buffer[c.Y]) {
-			c.X = len(b.buffer[c.Y])
+		if c.X >= b.lineLen(c.Y) {
+			c.X = b.lineLen(c.Y)
 			if c.X < 0 {
 				c.X = 0
 			}
@@ -1717,29 +1776,27 @@ func (e *Editor) deleteWord(includeSpaces bool) {
 
 		// Handle syntax update
 		if b.syntax != nil {
-			deletedBytes := uint32(len(string(line[start:end])))
-			oldColBytes := b.getLineByteOffset(line, start)
-			newColBytes := b.getLineByteOffset(newLine, start)
-			b.handleEdit(c.Y, start, deletedBytes, 0, c.Y, oldColBytes+deletedBytes, c.Y, newColBytes)
+			colBytes := b.getLineByteOffset(newLine, start)
+			b.handleEdit(c.Y, start, deletedBytes, 0, c.Y, colBytes+deletedBytes, c.Y, colBytes)
 		}
 	}
 
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 	e.markModified()
 }
 
 func (e *Editor) deleteWordBackward() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 || b.PrimaryCursor().Y >= len(b.buffer) {
+	if b == nil || b.lineCount() == 0 || b.PrimaryCursor().Y >= b.lineCount() {
 		return
 	}
 	if b.readOnly {
 		e.message = "File is read-only"
 		return
 	}
-	line := b.buffer[b.PrimaryCursor().Y]
+	line := b.line(b.PrimaryCursor().Y)
 	if len(line) == 0 || b.PrimaryCursor().X == 0 {
 		return
 	}
@@ -1769,20 +1826,19 @@ func (e *Editor) deleteWordBackward() {
 	}
 
 	// Delete from start to end
-	newLine := append(line[:start], line[end:]...)
-	b.buffer[b.PrimaryCursor().Y] = newLine
+	deletedBytes := byteLen(line[start:end])
+	newLine := append(line[:start:start], line[end:]...)
+	b.setLine(b.PrimaryCursor().Y, newLine)
 	b.PrimaryCursor().X = start
 
 	// Handle syntax update
 	if b.syntax != nil {
-		deletedBytes := uint32(len(string(line[start:end])))
-		oldColBytes := b.getLineByteOffset(line, start)
-		newColBytes := b.getLineByteOffset(newLine, start)
-		b.handleEdit(b.PrimaryCursor().Y, start, deletedBytes, 0, b.PrimaryCursor().Y, oldColBytes+deletedBytes, b.PrimaryCursor().Y, newColBytes)
+		colBytes := b.getLineByteOffset(newLine, start)
+		b.handleEdit(b.PrimaryCursor().Y, start, deletedBytes, 0, b.PrimaryCursor().Y, colBytes+deletedBytes, b.PrimaryCursor().Y, colBytes)
 	}
 
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 	e.markModified()
 }
@@ -1853,11 +1909,11 @@ func (e *Editor) deleteToEndOfLine() {
 
 	cursors := e.getSortedCursorsDesc()
 	for _, c := range cursors {
-		if c.Y >= len(b.buffer) {
+		if c.Y >= b.lineCount() {
 			continue
 		}
 
-		line := b.buffer[c.Y]
+		line := b.line(c.Y)
 		if c.X >= len(line) {
 			continue
 		}
@@ -1870,9 +1926,9 @@ func (e *Editor) deleteToEndOfLine() {
 		}
 
 		// Truncate the line at the cursor position
-		deletedBytes := uint32(len(string(line[c.X:])))
-		newLine := line[:c.X]
-		b.buffer[c.Y] = newLine
+		deletedBytes := byteLen(line[c.X:])
+		newLine := line[:c.X:c.X]
+		b.setLine(c.Y, newLine)
 
 		// Handle syntax update
 		if b.syntax != nil {
@@ -1883,7 +1939,7 @@ func (e *Editor) deleteToEndOfLine() {
 	}
 
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 	e.markModified()
 }
@@ -1901,14 +1957,14 @@ func (e *Editor) changeToEndOfLine() {
 // deleteInside removes text within a pair of delimiters (e.g., "", (), {}).
 func (e *Editor) deleteInside(open, close rune) bool {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return false
 	}
 	if b.readOnly {
 		e.message = "File is read-only"
 		return false
 	}
-	line := b.buffer[b.PrimaryCursor().Y]
+	line := b.line(b.PrimaryCursor().Y)
 	if len(line) == 0 {
 		return false
 	}
@@ -1970,10 +2026,10 @@ func (e *Editor) deleteInside(open, close rune) bool {
 		start := bestPair.start
 		end := bestPair.end
 		deletedChars := line[start+1 : end]
-		deletedBytes := uint32(len(string(deletedChars)))
+		deletedBytes := byteLen(deletedChars)
 
-		newLine := append(line[:start+1], line[end:]...)
-		b.buffer[b.PrimaryCursor().Y] = newLine
+		newLine := append(line[:start+1:start+1], line[end:]...)
+		b.setLine(b.PrimaryCursor().Y, newLine)
 		b.PrimaryCursor().X = start + 1
 
 		if b.syntax != nil {
@@ -1982,7 +2038,7 @@ func (e *Editor) deleteInside(open, close rune) bool {
 			b.handleEdit(b.PrimaryCursor().Y, start+1, deletedBytes, 0, b.PrimaryCursor().Y, oldColBytes+deletedBytes, b.PrimaryCursor().Y, newColBytes)
 		}
 		if b.syntax != nil {
-			b.syntax.Reparse([]byte(b.toString()))
+			b.syntax.Reparse(b.snapshot())
 		}
 		e.markModified()
 		return true
@@ -1998,7 +2054,7 @@ func (e *Editor) changeInside(open, close rune) {
 
 func (e *Editor) moveWordForward() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
 
@@ -2017,11 +2073,11 @@ func (e *Editor) moveWordForward() {
 	for i := range b.cursors {
 		cursor := &b.cursors[i]
 
-		if cursor.Y >= len(b.buffer) {
-			cursor.Y = len(b.buffer) - 1
+		if cursor.Y >= b.lineCount() {
+			cursor.Y = b.lineCount() - 1
 		}
 
-		currentLine := b.buffer[cursor.Y]
+		currentLine := b.line(cursor.Y)
 
 		// 1. Skip current word/punct clump
 		if cursor.X < len(currentLine) {
@@ -2039,8 +2095,8 @@ func (e *Editor) moveWordForward() {
 		// 2. Skip whitespace
 		for {
 			// If at end of line, move to next line
-			if cursor.X >= len(b.buffer[cursor.Y]) {
-				if cursor.Y < len(b.buffer)-1 {
+			if cursor.X >= b.lineLen(cursor.Y) {
+				if cursor.Y < b.lineCount()-1 {
 					cursor.Y++
 					cursor.X = 0
 					// Continue loop to check new line content
@@ -2049,10 +2105,10 @@ func (e *Editor) moveWordForward() {
 				}
 			}
 
-			line := b.buffer[cursor.Y]
+			line := b.line(cursor.Y)
 			if len(line) == 0 {
 				// Empty line, continue to next
-				if cursor.Y < len(b.buffer)-1 {
+				if cursor.Y < b.lineCount()-1 {
 					// We need to advance line manually here if we are on empty line
 					// but only if we haven't just moved to it (which is handled by loop re-entry)
 					// Actually, the check at top of loop handles line length check.
@@ -2090,7 +2146,7 @@ func (e *Editor) moveWordForward() {
 
 func (e *Editor) moveWordBackward() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
 
@@ -2105,7 +2161,7 @@ func (e *Editor) moveWordBackward() {
 			}
 			if cursor.Y > 0 {
 				cursor.Y--
-				cursor.X = len(b.buffer[cursor.Y])
+				cursor.X = b.lineLen(cursor.Y)
 				if cursor.X > 0 {
 					cursor.X--
 				}
@@ -2121,7 +2177,7 @@ func (e *Editor) moveWordBackward() {
 
 		// 2. Skip whitespace going back
 		for {
-			line := b.buffer[cursor.Y]
+			line := b.line(cursor.Y)
 			if len(line) == 0 {
 				if !stepBack() {
 					break
@@ -2140,7 +2196,7 @@ func (e *Editor) moveWordBackward() {
 		}
 
 		// 3. We are on last char of a "word". Go to its start.
-		line := b.buffer[cursor.Y]
+		line := b.line(cursor.Y)
 		getType := func(r rune) int {
 			if e.isWordChar(r) {
 				return 1
@@ -2172,7 +2228,7 @@ func (e *Editor) moveWordBackward() {
 // deleteLine removes the current line and saves it to the clipboard.
 func (e *Editor) deleteLine() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
 	if b.readOnly {
@@ -2180,44 +2236,52 @@ func (e *Editor) deleteLine() {
 		return
 	}
 
-	line := b.buffer[b.PrimaryCursor().Y]
+	line := b.line(b.PrimaryCursor().Y)
 	e.clipboard = make([]rune, len(line)+1)
 	copy(e.clipboard, line)
 	e.clipboard[len(line)] = '\n'
 
-	if len(b.buffer) == 1 {
-		lineLen := uint32(len(string(b.buffer[0])))
-		b.buffer[0] = []rune{}
+	if b.lineCount() == 1 {
+		lineLen := uint32(len(b.lineString(0)))
+		b.setLine(0, []rune{})
 		b.PrimaryCursor().X = 0
 
 		if b.syntax != nil {
 			b.handleEdit(0, 0, lineLen, 0, 0, lineLen, 0, 0)
 		}
 	} else {
-		lineLen := uint32(len(string(b.buffer[b.PrimaryCursor().Y]))) + 1
-		b.buffer = append(b.buffer[:b.PrimaryCursor().Y], b.buffer[b.PrimaryCursor().Y+1:]...)
+		y := b.PrimaryCursor().Y
+		lineLen := uint32(len(b.lineString(y))) + 1
+		b.deleteLines(y, y+1)
 
 		if b.syntax != nil {
-			b.handleEdit(b.PrimaryCursor().Y, 0, lineLen, 0, b.PrimaryCursor().Y+1, 0, b.PrimaryCursor().Y, 0)
+			if y < b.lineCount() {
+				b.handleEdit(y, 0, lineLen, 0, y+1, 0, y, 0)
+			} else {
+				// The last line has no trailing newline, so the removed text is
+				// the newline ending the previous line plus the line itself.
+				prevLen := uint32(len(b.lineString(y - 1)))
+				b.handleEdit(y-1, b.lineLen(y-1), lineLen, 0, y, lineLen-1, y-1, prevLen)
+			}
 		}
 
-		if b.PrimaryCursor().Y >= len(b.buffer) {
-			b.PrimaryCursor().Y = len(b.buffer) - 1
+		if b.PrimaryCursor().Y >= b.lineCount() {
+			b.PrimaryCursor().Y = b.lineCount() - 1
 		}
 		b.PrimaryCursor().X = 0
 	}
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 	e.markModified()
 }
 
 func (e *Editor) yankLine() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
-	line := b.buffer[b.PrimaryCursor().Y]
+	line := b.line(b.PrimaryCursor().Y)
 	e.clipboard = make([]rune, len(line)+1)
 	copy(e.clipboard, line)
 	e.clipboard[len(line)] = '\n'
@@ -2240,15 +2304,11 @@ func (e *Editor) pasteLine() {
 		parts := strings.Split(string(content), "\n")
 		count := len(parts)
 
-		newBuffer := make([][]rune, len(b.buffer)+count)
-		copy(newBuffer[:b.PrimaryCursor().Y+1], b.buffer[:b.PrimaryCursor().Y+1])
-
+		newLines := make([][]rune, count)
 		for i, part := range parts {
-			newBuffer[b.PrimaryCursor().Y+1+i] = []rune(part)
+			newLines[i] = []rune(part)
 		}
-
-		copy(newBuffer[b.PrimaryCursor().Y+1+count:], b.buffer[b.PrimaryCursor().Y+1:])
-		b.buffer = newBuffer
+		b.insertLines(b.PrimaryCursor().Y+1, newLines...)
 
 		b.PrimaryCursor().Y += count
 		b.PrimaryCursor().X = 0
@@ -2258,7 +2318,7 @@ func (e *Editor) pasteLine() {
 		parts := strings.Split(fullText, "\n")
 
 		if len(parts) == 1 {
-			line := b.buffer[b.PrimaryCursor().Y]
+			line := b.line(b.PrimaryCursor().Y)
 			at := b.PrimaryCursor().X
 			if len(line) > 0 {
 				at++
@@ -2271,14 +2331,14 @@ func (e *Editor) pasteLine() {
 			copy(newLine[:at], line[:at])
 			copy(newLine[at:], e.clipboard)
 			copy(newLine[at+len(e.clipboard):], line[at:])
-			b.buffer[b.PrimaryCursor().Y] = newLine
+			b.setLine(b.PrimaryCursor().Y, newLine)
 			b.PrimaryCursor().X = at + len(e.clipboard) - 1
 			if b.PrimaryCursor().X < 0 {
 				b.PrimaryCursor().X = 0
 			}
 		} else {
 			// Multi-line character-wise paste after cursor
-			line := b.buffer[b.PrimaryCursor().Y]
+			line := b.line(b.PrimaryCursor().Y)
 			at := b.PrimaryCursor().X
 			if len(line) > 0 {
 				at++
@@ -2303,11 +2363,8 @@ func (e *Editor) pasteLine() {
 			newLines[lastIndex] = append(newLines[lastIndex], suffix...)
 
 			// Insert into buffer
-			newBuffer := make([][]rune, len(b.buffer)+len(parts)-1)
-			copy(newBuffer[:b.PrimaryCursor().Y], b.buffer[:b.PrimaryCursor().Y])
-			copy(newBuffer[b.PrimaryCursor().Y:b.PrimaryCursor().Y+len(parts)], newLines)
-			copy(newBuffer[b.PrimaryCursor().Y+len(parts):], b.buffer[b.PrimaryCursor().Y+1:])
-			b.buffer = newBuffer
+			b.setLine(b.PrimaryCursor().Y, newLines[0])
+			b.insertLines(b.PrimaryCursor().Y+1, newLines[1:]...)
 
 			// Move cursor to end of pasted text
 			b.PrimaryCursor().Y = b.PrimaryCursor().Y + len(parts) - 1
@@ -2317,7 +2374,7 @@ func (e *Editor) pasteLine() {
 	e.markModified()
 
 	if b.syntax != nil {
-		b.syntax.Parse([]byte(b.toString()))
+		b.syntax.Parse(b.snapshot())
 	}
 }
 
@@ -2338,15 +2395,11 @@ func (e *Editor) pasteLineAbove() {
 		parts := strings.Split(string(content), "\n")
 		count := len(parts)
 
-		newBuffer := make([][]rune, len(b.buffer)+count)
-		copy(newBuffer[:b.PrimaryCursor().Y], b.buffer[:b.PrimaryCursor().Y])
-
+		newLines := make([][]rune, count)
 		for i, part := range parts {
-			newBuffer[b.PrimaryCursor().Y+i] = []rune(part)
+			newLines[i] = []rune(part)
 		}
-
-		copy(newBuffer[b.PrimaryCursor().Y+count:], b.buffer[b.PrimaryCursor().Y:])
-		b.buffer = newBuffer
+		b.insertLines(b.PrimaryCursor().Y, newLines...)
 
 		b.PrimaryCursor().X = 0
 	} else {
@@ -2357,7 +2410,7 @@ func (e *Editor) pasteLineAbove() {
 
 		if len(parts) == 1 {
 			// Single line character-wise paste
-			line := b.buffer[b.PrimaryCursor().Y]
+			line := b.line(b.PrimaryCursor().Y)
 			at := b.PrimaryCursor().X
 			if at > len(line) {
 				at = len(line)
@@ -2367,14 +2420,14 @@ func (e *Editor) pasteLineAbove() {
 			copy(newLine[:at], line[:at])
 			copy(newLine[at:], e.clipboard)
 			copy(newLine[at+len(e.clipboard):], line[at:])
-			b.buffer[b.PrimaryCursor().Y] = newLine
+			b.setLine(b.PrimaryCursor().Y, newLine)
 			b.PrimaryCursor().X = at + len(e.clipboard) - 1
 			if b.PrimaryCursor().X < 0 {
 				b.PrimaryCursor().X = 0
 			}
 		} else {
 			// Multi-line character-wise paste
-			line := b.buffer[b.PrimaryCursor().Y]
+			line := b.line(b.PrimaryCursor().Y)
 			prefix := line[:b.PrimaryCursor().X]
 			suffix := line[b.PrimaryCursor().X:]
 
@@ -2391,11 +2444,8 @@ func (e *Editor) pasteLineAbove() {
 			newLines[lastIndex] = append(newLines[lastIndex], suffix...)
 
 			// Insert into buffer
-			newBuffer := make([][]rune, len(b.buffer)+len(parts)-1)
-			copy(newBuffer[:b.PrimaryCursor().Y], b.buffer[:b.PrimaryCursor().Y])
-			copy(newBuffer[b.PrimaryCursor().Y:b.PrimaryCursor().Y+len(parts)], newLines)
-			copy(newBuffer[b.PrimaryCursor().Y+len(parts):], b.buffer[b.PrimaryCursor().Y+1:])
-			b.buffer = newBuffer
+			b.setLine(b.PrimaryCursor().Y, newLines[0])
+			b.insertLines(b.PrimaryCursor().Y+1, newLines[1:]...)
 
 			// Move cursor to end of pasted text
 			b.PrimaryCursor().Y = b.PrimaryCursor().Y + len(parts) - 1
@@ -2405,13 +2455,13 @@ func (e *Editor) pasteLineAbove() {
 	e.markModified()
 
 	if b.syntax != nil {
-		b.syntax.Parse([]byte(b.toString()))
+		b.syntax.Parse(b.snapshot())
 	}
 }
 
 func (e *Editor) duplicateLine() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
 	if b.readOnly {
@@ -2419,20 +2469,16 @@ func (e *Editor) duplicateLine() {
 		return
 	}
 
-	line := make([]rune, len(b.buffer[b.PrimaryCursor().Y]))
-	copy(line, b.buffer[b.PrimaryCursor().Y])
+	line := make([]rune, b.lineLen(b.PrimaryCursor().Y))
+	copy(line, b.line(b.PrimaryCursor().Y))
 
-	newBuffer := make([][]rune, len(b.buffer)+1)
-	copy(newBuffer[:b.PrimaryCursor().Y+1], b.buffer[:b.PrimaryCursor().Y+1])
-	newBuffer[b.PrimaryCursor().Y+1] = line
-	copy(newBuffer[b.PrimaryCursor().Y+2:], b.buffer[b.PrimaryCursor().Y+1:])
-	b.buffer = newBuffer
+	b.insertLines(b.PrimaryCursor().Y+1, line)
 
 	b.PrimaryCursor().Y++
 	e.markModified()
 
 	if b.syntax != nil {
-		b.syntax.Parse([]byte(b.toString()))
+		b.syntax.Parse(b.snapshot())
 	}
 }
 
@@ -2444,7 +2490,7 @@ func (e *Editor) jumpToPrevEmptyLine() {
 	}
 	// Search backwards from current line for an empty line
 	for y := b.PrimaryCursor().Y - 1; y >= 0; y-- {
-		if len(b.buffer[y]) == 0 {
+		if b.lineLen(y) == 0 {
 			b.PrimaryCursor().Y = y
 			b.PrimaryCursor().X = 0
 			return
@@ -2460,8 +2506,8 @@ func (e *Editor) jumpToNextEmptyLine() {
 		return
 	}
 	// Search forwards from current line for an empty line
-	for y := b.PrimaryCursor().Y + 1; y < len(b.buffer); y++ {
-		if len(b.buffer[y]) == 0 {
+	for y := b.PrimaryCursor().Y + 1; y < b.lineCount(); y++ {
+		if b.lineLen(y) == 0 {
 			b.PrimaryCursor().Y = y
 			b.PrimaryCursor().X = 0
 			return
@@ -2486,7 +2532,7 @@ func (e *Editor) jumpToBottom() {
 	if b == nil {
 		return
 	}
-	b.PrimaryCursor().Y = len(b.buffer) - 1
+	b.PrimaryCursor().Y = b.lineCount() - 1
 	if b.PrimaryCursor().Y < 0 {
 		b.PrimaryCursor().Y = 0
 	}
@@ -2495,15 +2541,15 @@ func (e *Editor) jumpToBottom() {
 
 func (e *Editor) jumpToLineEnd() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
-	b.PrimaryCursor().X = len(b.buffer[b.PrimaryCursor().Y])
+	b.PrimaryCursor().X = b.lineLen(b.PrimaryCursor().Y)
 }
 
 func (e *Editor) jumpToLineStart() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
 	b.PrimaryCursor().X = 0
@@ -2511,10 +2557,10 @@ func (e *Editor) jumpToLineStart() {
 
 func (e *Editor) jumpToFirstNonBlank() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
-	line := b.buffer[b.PrimaryCursor().Y]
+	line := b.line(b.PrimaryCursor().Y)
 	b.PrimaryCursor().X = 0
 	for i, r := range line {
 		if r != ' ' && r != '\t' {
@@ -2524,104 +2570,44 @@ func (e *Editor) jumpToFirstNonBlank() {
 	}
 }
 
-// saveState captures a deep copy of the current buffer and cursors for the undo stack.
+// saveState marks the start of an undoable action. The changes it makes are
+// recorded when the next action starts or on undo.
 func (e *Editor) saveState() {
 	b := e.activeBuffer()
 	if b == nil {
 		return
 	}
-	// Deep copy the buffer to ensure historical states aren't mutated.
-	bufferCopy := make([][]rune, len(b.buffer))
-	for i, line := range b.buffer {
-		lineCopy := make([]rune, len(line))
-		copy(lineCopy, line)
-		bufferCopy[i] = lineCopy
-	}
-
-	// Deep copy cursors.
-	cursorsCopy := make([]Cursor, len(b.cursors))
-	copy(cursorsCopy, b.cursors)
-
-	b.undoStack = append(b.undoStack, HistoryState{
-		buffer:  bufferCopy,
-		cursors: cursorsCopy,
-	})
-	// Cap undo stack at 100 entries to prevent memory exhaustion.
-	if len(b.undoStack) > 100 {
-		b.undoStack = b.undoStack[1:]
-	}
-	// Clear the redo stack whenever a new action is performed.
-	b.redoStack = []HistoryState{}
+	b.beginAction()
 }
 
 func (e *Editor) undo() {
 	b := e.activeBuffer()
-	if b == nil || len(b.undoStack) == 0 {
+	if b == nil || !b.undo() {
 		return
 	}
 
-	// Save current state to redo stack
-	bufferCopy := make([][]rune, len(b.buffer))
-	for i, line := range b.buffer {
-		lineCopy := make([]rune, len(line))
-		copy(lineCopy, line)
-		bufferCopy[i] = lineCopy
-	}
-	cursorsCopy := make([]Cursor, len(b.cursors))
-	copy(cursorsCopy, b.cursors)
-
-	b.redoStack = append(b.redoStack, HistoryState{
-		buffer:  bufferCopy,
-		cursors: cursorsCopy,
-	})
-
-	// Restore from undo stack
-	state := b.undoStack[len(b.undoStack)-1]
-	b.undoStack = b.undoStack[:len(b.undoStack)-1]
-	b.buffer = state.buffer
-	b.cursors = state.cursors
-
 	if b.syntax != nil {
-		b.syntax.Parse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
+	b.syncLSP()
 }
 
 func (e *Editor) redo() {
 	b := e.activeBuffer()
-	if b == nil || len(b.redoStack) == 0 {
+	if b == nil || !b.redo() {
 		return
 	}
 
-	// Save current state to undo stack
-	bufferCopy := make([][]rune, len(b.buffer))
-	for i, line := range b.buffer {
-		lineCopy := make([]rune, len(line))
-		copy(lineCopy, line)
-		bufferCopy[i] = lineCopy
-	}
-	cursorsCopy := make([]Cursor, len(b.cursors))
-	copy(cursorsCopy, b.cursors)
-
-	b.undoStack = append(b.undoStack, HistoryState{
-		buffer:  bufferCopy,
-		cursors: cursorsCopy,
-	})
-
-	// Restore from redo stack
-	state := b.redoStack[len(b.redoStack)-1]
-	b.redoStack = b.redoStack[:len(b.redoStack)-1]
-	b.buffer = state.buffer
-	b.cursors = state.cursors
-
 	if b.syntax != nil {
-		b.syntax.Parse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
+	b.syncLSP()
 }
 
 // JoinLines joins the current line with the next one.
 func (e *Editor) JoinLines() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) <= 1 {
+	if b == nil || b.lineCount() <= 1 {
 		return
 	}
 	if b.readOnly {
@@ -2630,12 +2616,12 @@ func (e *Editor) JoinLines() {
 	}
 
 	cursor := b.PrimaryCursor()
-	if cursor.Y >= len(b.buffer)-1 {
+	if cursor.Y >= b.lineCount()-1 {
 		return // Last line, nothing to join
 	}
 
-	currentLine := b.buffer[cursor.Y]
-	nextLine := b.buffer[cursor.Y+1]
+	currentLine := b.line(cursor.Y)
+	nextLine := b.line(cursor.Y + 1)
 
 	// Trim leading whitespace from next line
 	trimIdx := 0
@@ -2662,8 +2648,20 @@ func (e *Editor) JoinLines() {
 	newLine = append(newLine, trimmedNextLine...)
 
 	// Update buffer
-	b.buffer[cursor.Y] = newLine
-	b.buffer = append(b.buffer[:cursor.Y+1], b.buffer[cursor.Y+2:]...)
+	b.setLine(cursor.Y, newLine)
+	b.deleteLines(cursor.Y+1, cursor.Y+2)
+
+	if b.syntax != nil {
+		// The newline and the leading whitespace of the next line are replaced by
+		// an optional single space.
+		currentBytes := b.getLineByteOffset(currentLine, len(currentLine))
+		trimmedBytes := b.getLineByteOffset(nextLine, trimIdx)
+		addedBytes := uint32(0)
+		if needsSpace {
+			addedBytes = 1
+		}
+		b.handleEdit(cursor.Y, len(currentLine), 1+trimmedBytes, addedBytes, cursor.Y+1, trimmedBytes, cursor.Y, currentBytes+addedBytes)
+	}
 
 	// Set cursor position to the join point
 	cursor.X = len(currentLine)
@@ -2675,7 +2673,7 @@ func (e *Editor) JoinLines() {
 
 	// Syntax update
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 	e.markModified()
 }
@@ -2693,8 +2691,8 @@ func (e *Editor) getSelectionBounds() (int, int, int, int) {
 	// Force line-wise bounds if in Visual Line mode.
 	if e.mode == ModeVisualLine {
 		x1 = 0
-		if y2 < len(b.buffer) {
-			x2 = len(b.buffer[y2])
+		if y2 < b.lineCount() {
+			x2 = b.lineLen(y2)
 			if x2 > 0 {
 				x2-- // last character index
 			} else {
@@ -2722,7 +2720,7 @@ func (e *Editor) ollamaComplete() {
 	// Extract selected text for the prompt.
 	var selectedText strings.Builder
 	for y := y1; y <= y2; y++ {
-		line := b.buffer[y]
+		line := b.line(y)
 		if y == y1 && y == y2 {
 			if x1 < len(line) {
 				end := x2 + 1
@@ -2743,7 +2741,7 @@ func (e *Editor) ollamaComplete() {
 			}
 			selectedText.WriteString(string(line[:end]))
 		} else {
-			selectedText.WriteString(string(line))
+			selectedText.WriteString(b.lineString(y))
 			selectedText.WriteRune('\n')
 		}
 	}
@@ -2780,13 +2778,13 @@ func (e *Editor) ollamaComplete() {
 	lines := strings.Split(strings.TrimSpace(response), "\n")
 
 	at := b.PrimaryCursor().X
-	currentLine := b.buffer[b.PrimaryCursor().Y]
+	currentLine := b.line(b.PrimaryCursor().Y)
 	hasSuffix := at < len(currentLine)
 
-	nextExists := b.PrimaryCursor().Y+1 < len(b.buffer)
+	nextExists := b.PrimaryCursor().Y+1 < b.lineCount()
 	nextIsBlank := false
 	if nextExists {
-		nextIsBlank = len(b.buffer[b.PrimaryCursor().Y+1]) == 0
+		nextIsBlank = b.lineLen(b.PrimaryCursor().Y+1) == 0
 	}
 
 	// Add formatting newlines if necessary.
@@ -2797,7 +2795,7 @@ func (e *Editor) ollamaComplete() {
 	}
 
 	if len(lines) == 1 {
-		line := b.buffer[b.PrimaryCursor().Y]
+		line := b.line(b.PrimaryCursor().Y)
 		at := b.PrimaryCursor().X
 		if at > len(line) {
 			at = len(line)
@@ -2808,10 +2806,10 @@ func (e *Editor) ollamaComplete() {
 		copy(newLine[:at], line[:at])
 		copy(newLine[at:], respRunes)
 		copy(newLine[at+len(respRunes):], line[at:])
-		b.buffer[b.PrimaryCursor().Y] = newLine
+		b.setLine(b.PrimaryCursor().Y, newLine)
 		b.PrimaryCursor().X = at + len(respRunes)
 	} else {
-		line := b.buffer[b.PrimaryCursor().Y]
+		line := b.line(b.PrimaryCursor().Y)
 		at := b.PrimaryCursor().X
 		if at > len(line) {
 			at = len(line)
@@ -2828,11 +2826,8 @@ func (e *Editor) ollamaComplete() {
 		newLines[0] = append([]rune(string(prefix)), newLines[0]...)
 		newLines[len(newLines)-1] = append(newLines[len(newLines)-1], suffix...)
 
-		newBuffer := make([][]rune, len(b.buffer)+len(newLines)-1)
-		copy(newBuffer[:b.PrimaryCursor().Y], b.buffer[:b.PrimaryCursor().Y])
-		copy(newBuffer[b.PrimaryCursor().Y:], newLines)
-		copy(newBuffer[b.PrimaryCursor().Y+len(newLines):], b.buffer[b.PrimaryCursor().Y+1:])
-		b.buffer = newBuffer
+		b.setLine(b.PrimaryCursor().Y, newLines[0])
+		b.insertLines(b.PrimaryCursor().Y+1, newLines[1:]...)
 
 		b.PrimaryCursor().Y = b.PrimaryCursor().Y + len(newLines) - 1
 		b.PrimaryCursor().X = len(newLines[len(newLines)-1]) - len(suffix)
@@ -2843,7 +2838,7 @@ func (e *Editor) ollamaComplete() {
 	e.message = "Ollama completion inserted (replaced selection)"
 
 	if b.syntax != nil {
-		b.syntax.Parse([]byte(b.toString()))
+		b.syntax.Parse(b.snapshot())
 	}
 }
 
@@ -2853,7 +2848,7 @@ func (e *Editor) getSelection() []rune {
 	var selection []rune
 
 	for y := y1; y <= y2; y++ {
-		line := b.buffer[y]
+		line := b.line(y)
 		start := 0
 		end := len(line)
 
@@ -2907,12 +2902,12 @@ func (e *Editor) deleteVisualSelection() {
 
 	if e.mode == ModeVisualLine {
 		// Remove all selected lines
-		b.buffer = append(b.buffer[:y1], b.buffer[y2+1:]...)
-		if len(b.buffer) == 0 {
-			b.buffer = [][]rune{{}}
+		b.deleteLines(y1, y2+1)
+		if b.lineCount() == 0 {
+			b.insertLines(0, []rune{})
 		}
-		if y1 >= len(b.buffer) {
-			y1 = len(b.buffer) - 1
+		if y1 >= b.lineCount() {
+			y1 = b.lineCount() - 1
 		}
 		b.PrimaryCursor().Y = y1
 		b.PrimaryCursor().X = 0
@@ -2924,8 +2919,8 @@ func (e *Editor) deleteVisualSelection() {
 		}
 
 		for y := y1; y <= y2; y++ {
-			if y < len(b.buffer) {
-				line := b.buffer[y]
+			if y < b.lineCount() {
+				line := b.line(y)
 				s := startX
 				e := endX + 1
 				if s > len(line) {
@@ -2936,8 +2931,8 @@ func (e *Editor) deleteVisualSelection() {
 				}
 
 				if s < e {
-					newLine := append(line[:s], line[e:]...)
-					b.buffer[y] = newLine
+					newLine := append(line[:s:s], line[e:]...)
+					b.setLine(y, newLine)
 				}
 			}
 		}
@@ -2945,8 +2940,8 @@ func (e *Editor) deleteVisualSelection() {
 		b.PrimaryCursor().X = startX
 	} else {
 		// Modify buffer for character-wise selection
-		line1 := b.buffer[y1]
-		line2 := b.buffer[y2]
+		line1 := b.line(y1)
+		line2 := b.line(y2)
 
 		prefix := make([]rune, x1)
 		copy(prefix, line1[:x1])
@@ -2958,11 +2953,11 @@ func (e *Editor) deleteVisualSelection() {
 		}
 
 		newLine := append(prefix, suffix...)
-		b.buffer[y1] = newLine
+		b.setLine(y1, newLine)
 
 		// Remove lines between
 		if y1 != y2 {
-			b.buffer = append(b.buffer[:y1+1], b.buffer[y2+1:]...)
+			b.deleteLines(y1+1, y2+1)
 		}
 
 		b.PrimaryCursor().Y = y1
@@ -2973,7 +2968,7 @@ func (e *Editor) deleteVisualSelection() {
 	e.markModified()
 
 	if b.syntax != nil {
-		b.syntax.Parse([]byte(b.toString()))
+		b.syntax.Parse(b.snapshot())
 	}
 }
 
@@ -3014,18 +3009,18 @@ func (e *Editor) pasteVisualSelection() {
 
 func (e *Editor) toggleComment(y int) {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 || b.fileType == nil || b.fileType.Comment == "" {
+	if b == nil || b.lineCount() == 0 || b.fileType == nil || b.fileType.Comment == "" {
 		return
 	}
 	if b.readOnly {
 		e.message = "File is read-only"
 		return
 	}
-	if y < 0 || y >= len(b.buffer) {
+	if y < 0 || y >= b.lineCount() {
 		return
 	}
 
-	line := b.buffer[y]
+	line := b.line(y)
 	if len(line) == 0 {
 		return
 	}
@@ -3061,11 +3056,11 @@ func (e *Editor) toggleComment(y int) {
 		newLine = append(newLine, line...)
 	}
 
-	b.buffer[y] = newLine
+	b.setLine(y, newLine)
 	e.markModified()
 
 	if b.syntax != nil {
-		b.syntax.Parse([]byte(b.toString()))
+		b.syntax.Parse(b.snapshot())
 	}
 }
 
@@ -3086,20 +3081,23 @@ func (e *Editor) commentVisualSelection() {
 
 func (e *Editor) toggleCase(y, x int) (int, int) {
 	b := e.activeBuffer()
-	if b == nil || y < 0 || y >= len(b.buffer) {
+	if b == nil || y < 0 || y >= b.lineCount() {
 		return y, x
 	}
-	line := b.buffer[y]
+	line := b.line(y)
 	if x < 0 || x >= len(line) {
 		return y, x
 	}
 
+	// Lines may be shared with snapshots, so change a copy.
+	line = slices.Clone(line)
 	r := line[x]
 	if unicode.IsLower(r) {
 		line[x] = unicode.ToUpper(r)
 	} else if unicode.IsUpper(r) {
 		line[x] = unicode.ToLower(r)
 	}
+	b.setLine(y, line)
 
 	// Move cursor right
 	newX := x + 1
@@ -3115,7 +3113,7 @@ func (e *Editor) toggleCase(y, x int) (int, int) {
 
 func (e *Editor) ToggleCaseUnderCursor() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
 	if b.readOnly {
@@ -3128,13 +3126,13 @@ func (e *Editor) ToggleCaseUnderCursor() {
 	e.markModified()
 
 	if b.syntax != nil {
-		b.syntax.Parse([]byte(b.toString()))
+		b.syntax.Parse(b.snapshot())
 	}
 }
 
 func (e *Editor) ToggleCaseVisualSelection() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
 	if b.readOnly {
@@ -3146,7 +3144,8 @@ func (e *Editor) ToggleCaseVisualSelection() {
 	y1, x1, y2, x2 := e.getSelectionBounds()
 
 	for y := y1; y <= y2; y++ {
-		line := b.buffer[y]
+		// Lines may be shared with snapshots, so change a copy.
+		line := slices.Clone(b.line(y))
 		start := 0
 		end := len(line) - 1
 		if y == y1 {
@@ -3164,13 +3163,14 @@ func (e *Editor) ToggleCaseVisualSelection() {
 				line[x] = unicode.ToLower(r)
 			}
 		}
+		b.setLine(y, line)
 	}
 
 	e.mode = ModeNormal
 	e.markModified()
 
 	if b.syntax != nil {
-		b.syntax.Parse([]byte(b.toString()))
+		b.syntax.Parse(b.snapshot())
 	}
 }
 
@@ -3195,7 +3195,7 @@ func detectCommentPrefix(text string) string {
 // It formats either the current line in normal mode or the selected lines in visual modes.
 func (e *Editor) formatText() {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 {
+	if b == nil || b.lineCount() == 0 {
 		return
 	}
 	if b.readOnly {
@@ -3228,8 +3228,8 @@ func (e *Editor) formatText() {
 
 	// Process lines in groups (paragraphs) with the same indentation and comment prefix
 	lineIdx := startLine
-	for lineIdx <= endLine && lineIdx < len(b.buffer) {
-		line := b.buffer[lineIdx]
+	for lineIdx <= endLine && lineIdx < b.lineCount() {
+		line := b.line(lineIdx)
 
 		// Handle empty lines
 		if len(line) == 0 {
@@ -3257,8 +3257,8 @@ func (e *Editor) formatText() {
 		var paragraphText []string
 		paragraphStartIdx := lineIdx
 
-		for lineIdx <= endLine && lineIdx < len(b.buffer) {
-			currentLine := b.buffer[lineIdx]
+		for lineIdx <= endLine && lineIdx < b.lineCount() {
+			currentLine := b.line(lineIdx)
 
 			// Stop at empty lines
 			if len(currentLine) == 0 {
@@ -3302,7 +3302,7 @@ func (e *Editor) formatText() {
 		if len(words) == 0 {
 			// Just preserve the line structure if no words
 			for i := paragraphStartIdx; i < lineIdx; i++ {
-				newLines = append(newLines, b.buffer[i])
+				newLines = append(newLines, b.line(i))
 			}
 			continue
 		}
@@ -3356,20 +3356,15 @@ func (e *Editor) formatText() {
 
 	// Replace the lines in the buffer
 	if len(newLines) > 0 {
-		newBuffer := make([][]rune, 0)
-		newBuffer = append(newBuffer, b.buffer[:startLine]...)
-		newBuffer = append(newBuffer, newLines...)
-		if endLine+1 < len(b.buffer) {
-			newBuffer = append(newBuffer, b.buffer[endLine+1:]...)
-		}
-		b.buffer = newBuffer
+		b.deleteLines(startLine, min(endLine+1, b.lineCount()))
+		b.insertLines(startLine, newLines...)
 
 		// Adjust cursor position
-		if b.PrimaryCursor().Y > len(b.buffer)-1 {
-			b.PrimaryCursor().Y = len(b.buffer) - 1
+		if b.PrimaryCursor().Y > b.lineCount()-1 {
+			b.PrimaryCursor().Y = b.lineCount() - 1
 		}
-		if b.PrimaryCursor().Y >= 0 && b.PrimaryCursor().X > len(b.buffer[b.PrimaryCursor().Y]) {
-			b.PrimaryCursor().X = len(b.buffer[b.PrimaryCursor().Y])
+		if b.PrimaryCursor().Y >= 0 && b.PrimaryCursor().X > b.lineLen(b.PrimaryCursor().Y) {
+			b.PrimaryCursor().X = b.lineLen(b.PrimaryCursor().Y)
 		}
 	}
 
@@ -3377,7 +3372,7 @@ func (e *Editor) formatText() {
 	e.markModified()
 
 	if b.syntax != nil {
-		b.syntax.Parse([]byte(b.toString()))
+		b.syntax.Parse(b.snapshot())
 	}
 
 	e.message = "Text formatted"
@@ -3386,7 +3381,7 @@ func (e *Editor) formatText() {
 // performSearch performs a linear case-insensitive search for a query string.
 func (e *Editor) performSearch(query string, forward bool) {
 	b := e.activeBuffer()
-	if b == nil || len(b.buffer) == 0 || query == "" {
+	if b == nil || b.lineCount() == 0 || query == "" {
 		return
 	}
 
@@ -3403,9 +3398,8 @@ func (e *Editor) performSearch(query string, forward bool) {
 	firstLoop := true
 
 	// Loop through the entire buffer once.
-	for i := 0; i <= len(b.buffer); i++ {
-		line := string(b.buffer[y])
-		lineLower := strings.ToLower(line)
+	for i := 0; i <= b.lineCount(); i++ {
+		lineLower := strings.ToLower(b.lineString(y))
 
 		matches := []int{}
 		// Scan line for all occurrences.
@@ -3415,7 +3409,7 @@ func (e *Editor) performSearch(query string, forward bool) {
 				break
 			}
 			matchPos := pos + idx
-			matches = append(matches, matchPos)
+			matches = append(matches, b.runeCol(y, uint32(matchPos)))
 			pos = matchPos + 1
 		}
 
@@ -3446,8 +3440,8 @@ func (e *Editor) performSearch(query string, forward bool) {
 		// Wrap around buffer boundaries.
 		y += dir
 		if y < 0 {
-			y = len(b.buffer) - 1
-		} else if y >= len(b.buffer) {
+			y = b.lineCount() - 1
+		} else if y >= b.lineCount() {
 			y = 0
 		}
 
@@ -3473,17 +3467,13 @@ func (e *Editor) checkDiagnostics() {
 
 	e.addLog("LSP", "Checking diagnostics...")
 
-	// Send current buffer content to LSP
-	content := e.bufferToString(b.buffer)
-	if err := b.lspClient.SendDidChange(content); err != nil {
-		e.addLog("LSP", fmt.Sprintf("didChange error: %v", err))
-		return
-	}
+	// Queue the changes since the last sync for LSP
+	b.syncLSP()
 
 	// Diagnostics will be updated asynchronously when clangd sends publishDiagnostics
 	// The background readMessages goroutine handles this automatically
 	// Get current diagnostics (may be from previous check)
-	b.diagnostics = b.lspClient.GetDiagnostics()
+	b.refreshDiagnostics()
 	e.addLog("LSP", fmt.Sprintf("Current diagnostics: %d", len(b.diagnostics)))
 }
 
@@ -3492,10 +3482,15 @@ func (e *Editor) deleteCurrentBuffer() {
 		return
 	}
 
-	// Shutdown LSP client if active
+	// Close the document in the LSP server
 	b := e.activeBuffer()
 	if b != nil && b.lspClient != nil {
-		b.lspClient.Shutdown()
+		b.lspClient.Close()
+	}
+
+	// Stop the syntax worker.
+	if b != nil && b.syntax != nil {
+		b.syntax.Close()
 	}
 
 	// Remove the current buffer
@@ -3506,7 +3501,7 @@ func (e *Editor) deleteCurrentBuffer() {
 		// No more buffers, create an empty one
 		defaultType := fileTypes[len(fileTypes)-1]
 		e.buffers = append(e.buffers, &Buffer{
-			buffer:    [][]rune{{}},
+			text:      newRope([]string{""}),
 			undoStack: []HistoryState{},
 			redoStack: []HistoryState{},
 			fileType:  defaultType,
@@ -3569,41 +3564,23 @@ func (e *Editor) drawStatusBar(statusY int) {
 	termbox.SetCell(len(modeStr)+1, statusY, ' ', fg, bg)
 
 	// Draw filename and modification status.
-	fileStr := "[no file]"
-	if b.filename != "" {
-		fileStr = b.filename
-	}
-	if b.modified {
-		fileStr += " [+]"
-	}
-	if b.readOnly {
-		fileStr += " (read-only)"
-	}
+	fileStr := e.scratch.fileStatus(b)
 	fileX := len(modeStr) + 2 + 1
-	for i, r := range fileStr {
-		fg, bg := GetThemeColor(ColorStatusBar)
-		termbox.SetCell(fileX+i, statusY, r, fg, bg)
-	}
+	fg, bg = GetThemeColor(ColorStatusBar)
+	drawText(fileStr, fileX, statusY, w, fg, bg)
 
 	// Draw cursor coordinates and file metadata.
 	lineNum := b.PrimaryCursor().Y + 1
-	visualCol := e.bufferToVisual(b.buffer[b.PrimaryCursor().Y], b.PrimaryCursor().X) + 1
-	totalLines := len(b.buffer)
+	visualCol := e.bufferToVisual(b.line(b.PrimaryCursor().Y), b.PrimaryCursor().X) + 1
+	totalLines := b.lineCount()
 	percent := 0
 	if totalLines > 0 {
 		percent = (lineNum * 100) / totalLines
 	}
-	fileTypeStr := "text"
-	if b.fileType != nil {
-		fileTypeStr = strings.ToLower(b.fileType.Name)
-	}
-	statusRight := fmt.Sprintf("(%s) [%d/%d] %d,%d %d%% ", fileTypeStr, e.activeBufferIndex+1, len(e.buffers), lineNum, visualCol, percent)
+	statusRight := e.scratch.positionStatus(b.fileType, e.activeBufferIndex+1, len(e.buffers), lineNum, visualCol, percent)
 	rightPositionWidth := 6
 	rightX := w - len(statusRight) - rightPositionWidth
-	for i, r := range statusRight {
-		fg, bg := GetThemeColor(ColorStatusBar)
-		termbox.SetCell(rightX+i, statusY, r, fg, bg)
-	}
+	drawText(statusRight, rightX, statusY, w, fg, bg)
 
 	// Draw connectivity status for LSP and Ollama.
 	lspColor := ColorLSPStatusDisconnected
@@ -3662,32 +3639,11 @@ func (e *Editor) drawCommandBar(cmdY int) {
 		// Show LSP diagnostics when not in command/fuzzy/find mode
 		b := e.activeBuffer()
 		if b != nil && len(b.diagnostics) > 0 {
-			// Count errors and warnings
-			errorCount := 0
-			for _, d := range b.diagnostics {
-				if d.Severity == 1 { // Error
-					errorCount++
-				}
-			}
+			errorCount := b.diagIndex.errors
 
-			// Show diagnostic summary
-			diagStr := ""
-			if errorCount > 0 {
-				diagStr = fmt.Sprintf("%d error(s): ", errorCount)
-			} else {
-				diagStr = fmt.Sprintf("%d diag(s): ", len(b.diagnostics))
-			}
-
-			// Add first error message (truncated if too long)
-			// Make it as long as possible as width of the terminal allows
-			if len(b.diagnostics) > 0 {
-				firstMsg := b.diagnostics[0].Message
-				maxMsgLen := w - len(diagStr)
-				if len(firstMsg) > maxMsgLen {
-					firstMsg = firstMsg[:maxMsgLen-3] + "..."
-				}
-				diagStr += firstMsg
-			}
+			// Show diagnostic summary with the first message, as long as
+			// the width of the terminal allows.
+			diagStr := e.scratch.diagSummary(b, w)
 
 			// Draw diagnostic text using theme colors
 			fg, _ := GetThemeColor(ColorDiagSummaryError)
@@ -3695,13 +3651,8 @@ func (e *Editor) drawCommandBar(cmdY int) {
 				fg, _ = GetThemeColor(ColorDiagSummaryWarning)
 			}
 
-			for i, r := range diagStr {
-				if i >= w {
-					break
-				}
-				_, bg := GetThemeColor(ColorDefault)
-				termbox.SetCell(i, cmdY, r, fg, bg)
-			}
+			_, bg := GetThemeColor(ColorDefault)
+			drawText(diagStr, 0, cmdY, w, fg, bg)
 			return
 		}
 	}
@@ -3719,10 +3670,9 @@ func (e *Editor) drawCommandBar(cmdY int) {
 	}
 }
 
-func (e *Editor) highlightLine(lineIdx int, line []rune) ([]termbox.Attribute, []termbox.Attribute) {
-	fgAttrs := make([]termbox.Attribute, len(line))
-	bgAttrs := make([]termbox.Attribute, len(line))
-
+// highlightLine fills fgAttrs and bgAttrs, which have the length of line, with
+// the colors of its runes.
+func (e *Editor) highlightLine(lineIdx int, line []rune, fgAttrs, bgAttrs []termbox.Attribute) {
 	// specific default color for text
 	defaultFg, defaultBg := GetThemeColor(ColorDefault)
 
@@ -3733,17 +3683,9 @@ func (e *Editor) highlightLine(lineIdx int, line []rune) ([]termbox.Attribute, [
 
 	b := e.activeBuffer()
 	if b != nil && b.syntax != nil {
-		attrs := b.syntax.Highlight(lineIdx, line)
-		// SyntaxHighlighter returns FG colors.
-		// We trust it to return a slice of the same length as line (or we handle potential mismatch if necessary,
-		// but the current implementation of Highlight seems to handle checks).
-		// Overwrite default FGs with syntax FGs where they differ from default?
-		// Or just replace entirely? syntax.Highlight initializes with defaultFg.
-		// So we can just use it.
-		fgAttrs = attrs
+		// SyntaxHighlighter only sets FG colors.
+		b.syntax.Highlight(lineIdx, line, fgAttrs)
 	}
-
-	return fgAttrs, bgAttrs
 }
 
 func matchesKeyword(runes []rune, start int, keyword string) bool {
@@ -3770,11 +3712,12 @@ func isWordStart(line []rune, i int) bool {
 // draw is the main UI rendering loop.
 func (e *Editor) draw() {
 	_, defaultBg := GetThemeColor(ColorDefault)
-	termbox.Clear(termbox.ColorDefault, defaultBg)
 	w, h := termbox.Size()
 	b := e.activeBuffer()
 	if b == nil {
+		termbox.Clear(termbox.ColorDefault, defaultBg)
 		termbox.Flush()
+		e.screen = screenState{}
 		return
 	}
 
@@ -3793,7 +3736,7 @@ func (e *Editor) draw() {
 	}
 
 	// Horizontal scroll management.
-	visualCursorX := e.bufferToVisual(b.buffer[b.PrimaryCursor().Y], b.PrimaryCursor().X)
+	visualCursorX := e.bufferToVisual(e.scratch.line(b, b.PrimaryCursor().Y), b.PrimaryCursor().X)
 	if visualCursorX < b.scrollX {
 		b.scrollX = visualCursorX
 	}
@@ -3801,38 +3744,92 @@ func (e *Editor) draw() {
 		b.scrollX = visualCursorX - textWidth + 1
 	}
 
-	// Optimized mapping for faster cursor lookup during rendering.
-	cursorMap := make(map[int]map[int]bool)
-	for _, c := range b.cursors {
-		if _, ok := cursorMap[c.Y]; !ok {
-			cursorMap[c.Y] = make(map[int]bool)
+	// Only the visible lines need up to date syntax highlights.
+	if b.syntax != nil {
+		b.syntax.EnsureHighlighted(b.scrollY, b.scrollY+visibleHeight)
+	}
+
+	// Cursors in order, so each row takes its own from the front.
+	e.scratch.sortCursors(b.cursors)
+	cursors := e.scratch.cursors
+
+	inVisual := e.mode == ModeVisual || e.mode == ModeVisualLine || e.mode == ModeVisualBlock
+	var vStartY, vStartX, vEndY, vEndX int
+	if inVisual {
+		y1, x1, y2, x2 := e.getSelectionBounds()
+		vStartY, vStartX, vEndY, vEndX = y1, x1, y2, x2
+		if e.mode == ModeVisualBlock {
+			if vStartX > vEndX {
+				vStartX, vEndX = vEndX, vStartX
+			}
 		}
-		cursorMap[c.Y][c.X] = true
 	}
 
+	// Repaint only the text rows that changed, unless something covers them.
+	showIntro := !e.introDismissed && b.filename == "" && b.lineCount() == 1 && b.lineLen(0) == 0 && !b.modified && e.mode != ModeInsert
+	overlay := showIntro || e.mode == ModeFuzzy || e.mode == ModeReplace || e.showDebugLog || e.showHover || e.showAutocomplete
+	full := e.screen.beginFrame(frameKey{
+		width:    w,
+		height:   h,
+		rows:     visibleHeight,
+		buffer:   b,
+		fileType: b.fileType,
+		scrollX:  b.scrollX,
+		search:   e.lastSearch,
+		palette:  currentPalette.Load(),
+	}, overlay)
+	if full {
+		termbox.Clear(termbox.ColorDefault, defaultBg)
+	}
+
+	var rh rowHash
 	for screenY := 0; screenY < visibleHeight; screenY++ {
 		bufferY := screenY + b.scrollY
-		if bufferY < len(b.buffer) {
+
+		for len(cursors) > 0 && cursors[0].Y < bufferY {
+			cursors = cursors[1:]
+		}
+		rowCursors := cursors
+		for len(cursors) > 0 && cursors[0].Y == bufferY {
+			cursors = cursors[1:]
+		}
+		rowCursors = rowCursors[:len(rowCursors)-len(cursors)]
+
+		rh.reset(e.screen.seed)
+		e.hashTextRow(&rh, b, bufferY, rowCursors)
+		if inVisual && bufferY >= vStartY && bufferY <= vEndY {
+			rh.int(int(e.mode))
+			rh.int(vStartX)
+			rh.int(vEndX)
+			rh.int(vStartY - bufferY)
+			rh.int(vEndY - bufferY)
+		}
+		if !e.screen.rowChanged(screenY, rh.sum()) && !full {
+			continue
+		}
+		if !full {
+			clearRow(screenY, w)
+		}
+
+		if bufferY < b.lineCount() {
 			// LSP diagnostic sign rendering.
 			diagSign := ' '
 			diagColor, diagBg := GetThemeColor(ColorDefault)
-			if b.diagnostics != nil {
-				for _, diag := range b.diagnostics {
-					if diag.Range.Start.Line == bufferY {
-						if diag.Severity == 1 {
-							diagSign = 'E'
-							diagColor, diagBg = GetThemeColor(ColorGutterSignError)
-						} else if diag.Severity == 2 && diagSign != 'E' {
-							diagSign = 'W'
-							diagColor, diagBg = GetThemeColor(ColorGutterSignWarning)
-						} else if diag.Severity == 3 && diagSign != 'E' {
-							diagSign = 'I'
-							diagColor, diagBg = GetThemeColor(ColorGutterSignInfo)
-						} else if diag.Severity == 4 && diagSign != 'E' {
-							diagSign = 'H'
-							diagColor, diagBg = GetThemeColor(ColorGutterSignHint)
-						}
-					}
+			lineDiags := b.diagIndex.at(bufferY)
+			if lineDiags != nil {
+				switch lineDiags.severity {
+				case 1:
+					diagSign = 'E'
+					diagColor, diagBg = GetThemeColor(ColorGutterSignError)
+				case 2:
+					diagSign = 'W'
+					diagColor, diagBg = GetThemeColor(ColorGutterSignWarning)
+				case 3:
+					diagSign = 'I'
+					diagColor, diagBg = GetThemeColor(ColorGutterSignInfo)
+				case 4:
+					diagSign = 'H'
+					diagColor, diagBg = GetThemeColor(ColorGutterSignHint)
 				}
 			}
 
@@ -3840,20 +3837,18 @@ func (e *Editor) draw() {
 			termbox.SetCell(1, screenY, ' ', diagBg, diagBg)
 
 			// Gutter line number rendering.
-			lineNum := strconv.Itoa(bufferY + 1)
+			lineNum := e.scratch.lineNumber(bufferY + 1)
 			gutterFg, gutterBg := GetThemeColor(ColorGutterLineNumber)
-			for i, r := range lineNum {
-				termbox.SetCell(Config.GutterWidth-len(lineNum)-1+i, screenY, r, gutterFg, gutterBg)
+			for i, c := range lineNum {
+				termbox.SetCell(Config.GutterWidth-len(lineNum)-1+i, screenY, rune(c), gutterFg, gutterBg)
 			}
 
 			// Text highlighting and rendering block.
-			var fgAttrs []termbox.Attribute
-			var bgAttrs []termbox.Attribute
+			lineRunes := e.scratch.line(b, bufferY)
+			fgAttrs, bgAttrs := e.scratch.fg, e.scratch.bg
 			if b.fileType != nil && b.fileType.Name != "Default" {
-				fgAttrs, bgAttrs = e.highlightLine(bufferY, b.buffer[bufferY])
+				e.highlightLine(bufferY, lineRunes, fgAttrs, bgAttrs)
 			} else {
-				fgAttrs = make([]termbox.Attribute, len(b.buffer[bufferY]))
-				bgAttrs = make([]termbox.Attribute, len(b.buffer[bufferY]))
 				for k := range fgAttrs {
 					fgAttrs[k], bgAttrs[k] = GetThemeColor(ColorDefault)
 				}
@@ -3868,43 +3863,11 @@ func (e *Editor) draw() {
 				}
 			}
 
-			inVisual := e.mode == ModeVisual || e.mode == ModeVisualLine || e.mode == ModeVisualBlock
-			var vStartY, vStartX, vEndY, vEndX int
-			if inVisual {
-				y1, x1, y2, x2 := e.getSelectionBounds()
-				vStartY, vStartX, vEndY, vEndX = y1, x1, y2, x2
-				if e.mode == ModeVisualBlock {
-					if vStartX > vEndX {
-						vStartX, vEndX = vEndX, vStartX
-					}
-				}
-			}
-
-			searchMatches := []bool{}
-			if e.lastSearch != "" {
-				searchMatches = make([]bool, len(b.buffer[bufferY]))
-				lineRunes := b.buffer[bufferY]
-				queryRunes := []rune(strings.ToLower(e.lastSearch))
-				queryLen := len(queryRunes)
-
-				for i := 0; i <= len(lineRunes)-queryLen; i++ {
-					match := true
-					for j := 0; j < queryLen; j++ {
-						if unicode.ToLower(lineRunes[i+j]) != queryRunes[j] {
-							match = false
-							break
-						}
-					}
-					if match {
-						for k := 0; k < queryLen; k++ {
-							searchMatches[i+k] = true
-						}
-					}
-				}
-			}
+			searchMatches := e.scratch.searchMatches(lineRunes, e.lastSearch)
+			underline := lineDiags.underlines()
 
 			visualX := 0
-			for idx, r := range b.buffer[bufferY] {
+			for idx, r := range lineRunes {
 				width := e.visualWidth(r, visualX)
 
 				charBg := bg
@@ -3939,12 +3902,10 @@ func (e *Editor) draw() {
 					}
 				}
 
-				isCursor := false
-				if cm, ok := cursorMap[bufferY]; ok {
-					if cm[idx] {
-						isCursor = true
-					}
+				for len(rowCursors) > 0 && rowCursors[0].X < idx {
+					rowCursors = rowCursors[1:]
 				}
+				isCursor := len(rowCursors) > 0 && rowCursors[0].X == idx
 
 				if isVisualSelected {
 					selFg, selBg := GetThemeColor(ColorVisualModeSelection)
@@ -3984,6 +3945,11 @@ func (e *Editor) draw() {
 					charBg = bgAttrs[idx]
 				}
 
+				// Underline the ranges of the line's diagnostics.
+				if underline.covers(idx) {
+					fgAttrs[idx] |= termbox.AttrUnderline
+				}
+
 				for i := 0; i < width; i++ {
 					screenX := visualX + i - b.scrollX
 					if screenX >= 0 && screenX < textWidth {
@@ -4011,7 +3977,7 @@ func (e *Editor) draw() {
 		}
 	}
 
-	if !e.introDismissed && b.filename == "" && len(b.buffer) == 1 && len(b.buffer[0]) == 0 && !b.modified && e.mode != ModeInsert {
+	if showIntro {
 		e.drawIntro()
 	}
 
@@ -4116,12 +4082,7 @@ func (e *Editor) drawDebugDiagnostics() {
 	}
 
 	// Add recent log messages (last 8)
-	startLog := 0
-	if len(e.logMessages) > Config.NumLogsInDebugWindow {
-		startLog = len(e.logMessages) - Config.NumLogsInDebugWindow
-	}
-	for i := startLog; i < len(e.logMessages); i++ {
-		msg := e.logMessages[i]
+	for _, msg := range e.log.recent(Config.NumLogsInDebugWindow) {
 		if len(msg) > w-2 {
 			msg = msg[:w-5] + "..."
 		}
@@ -4194,8 +4155,8 @@ func (e *Editor) centerScreen() {
 	if targetScrollY < 0 {
 		targetScrollY = 0
 	}
-	if targetScrollY > len(b.buffer)-visibleHeight {
-		targetScrollY = len(b.buffer) - visibleHeight
+	if targetScrollY > b.lineCount()-visibleHeight {
+		targetScrollY = b.lineCount() - visibleHeight
 	}
 	if targetScrollY < 0 {
 		targetScrollY = 0
@@ -4237,7 +4198,7 @@ func (e *Editor) addCursorBelow() {
 		}
 	}
 
-	if maxY < len(b.buffer)-1 {
+	if maxY < b.lineCount()-1 {
 		b.AddCursor(targetX, maxY+1)
 	}
 }
@@ -4280,7 +4241,7 @@ func (e *Editor) drawHoverPopup() {
 	popupHeight := len(lines) + (paddingY * 2)
 
 	// Calculate position (above cursor)
-	visualCursorX := e.bufferToVisual(b.buffer[b.PrimaryCursor().Y], b.PrimaryCursor().X)
+	visualCursorX := e.bufferToVisual(b.line(b.PrimaryCursor().Y), b.PrimaryCursor().X)
 	cursorScreenX := visualCursorX - b.scrollX + Config.GutterWidth
 	cursorScreenY := b.PrimaryCursor().Y - b.scrollY
 
@@ -4331,46 +4292,185 @@ func (e *Editor) triggerHover() {
 	}
 
 	e.message = "Requesting signature..."
-	e.draw()
 
-	cursor := b.PrimaryCursor()
-	content, err := b.lspClient.Hover(cursor.Y, cursor.X)
-	if err != nil {
-		e.message = fmt.Sprintf("LSP Hover error: %v", err)
-		return
-	}
+	cursor := *b.PrimaryCursor()
+	b.lspClient.Hover(b.lspPosition(b.lspClient.Encoding(), cursor.Y, cursor.X), func(content string, err error) {
+		e.postResult(func() {
+			if e.cursorMoved(b, cursor) {
+				return
+			}
+			if err != nil {
+				e.message = fmt.Sprintf("LSP Hover error: %v", err)
+				return
+			}
+
+			e.message = ""
+			e.hoverContent = content
+			e.showHover = true
+		})
+	})
+}
 
-	e.hoverContent = content
-	e.showHover = true
+// completionCache is the last completion list from the server and the word
+// it was asked for. While the user keeps typing that word the list is
+// narrowed locally instead of asking the server again. It is reset when
+// insert mode ends, a completion is inserted, or an edit leaves the word.
+type completionCache struct {
+	buffer     *Buffer
+	line       int
+	start      int    // Rune column where the word starts.
+	prefix     string // Part of the word the list was fetched for; it covers longer prefixes only.
+	items      []CompletionItem
+	incomplete bool // The server has more items for longer prefixes.
 }
 
-// triggerAutocomplete initiates an LSP completion request for the current cursor position.
+// triggerAutocomplete shows completions for the word at the cursor. The
+// cached list is used when it covers the word; otherwise, or when the server
+// marked it incomplete, an LSP completion request is sent.
 func (e *Editor) triggerAutocomplete() {
 	b := e.activeBuffer()
 	if b == nil || b.lspClient == nil {
 		return
 	}
 
+	cursor := *b.PrimaryCursor()
+	start, prefix := completionWord(b)
+	if e.completionCached(b) && !e.completion.incomplete {
+		if !e.filterCompletion(b) {
+			e.message = "No completions available"
+		}
+		return
+	}
 	e.message = "Requesting completions..."
-	e.draw()
 
-	cursor := b.PrimaryCursor()
-	items, err := b.lspClient.Completion(cursor.Y, cursor.X)
-	if err != nil {
-		e.message = fmt.Sprintf("LSP Completion error: %v", err)
+	b.lspClient.Completion(b.lspPosition(b.lspClient.Encoding(), cursor.Y, cursor.X), func(list CompletionList, err error) {
+		e.postResult(func() {
+			// The answer still applies while the cursor is in the same word.
+			if e.mode != ModeInsert || e.activeBuffer() != b || b.PrimaryCursor().Y != cursor.Y {
+				return
+			}
+			if s, _ := completionWord(b); s != start {
+				return
+			}
+			if err != nil {
+				e.message = fmt.Sprintf("LSP Completion error: %v", err)
+				return
+			}
+
+			e.completion = completionCache{
+				buffer:     b,
+				line:       cursor.Y,
+				start:      start,
+				prefix:     prefix,
+				items:      list.Items,
+				incomplete: list.IsIncomplete,
+			}
+			e.message = ""
+			if !e.filterCompletion(b) {
+				e.message = "No completions available"
+			}
+		})
+	})
+}
+
+// refineCompletion updates the open completion popup after the word at the
+// cursor changed, and closes it once the cursor leaves the word.
+func (e *Editor) refineCompletion() {
+	b := e.activeBuffer()
+	if b == nil {
 		return
 	}
-
-	if len(items) == 0 {
-		e.message = "No completions available"
+	if !e.inCompletionWord(b) {
+		e.showAutocomplete = false
 		return
 	}
+	e.triggerAutocomplete()
+}
+
+// inCompletionWord reports whether the cursor of b is in the word the cached
+// completion list was fetched for.
+func (e *Editor) inCompletionWord(b *Buffer) bool {
+	c := &e.completion
+	start, _ := completionWord(b)
+	return c.buffer == b && c.line == b.PrimaryCursor().Y && c.start == start
+}
 
-	e.autocompleteItems = items
+// completionCached reports whether the cached completion list covers the
+// word at the cursor of b: the same word, typed at least as far as when the
+// list was fetched.
+func (e *Editor) completionCached(b *Buffer) bool {
+	_, prefix := completionWord(b)
+	return e.inCompletionWord(b) && strings.HasPrefix(prefix, e.completion.prefix)
+}
+
+// filterCompletion shows the cached completion items that fuzzy match the
+// part of the word before the cursor, best matches first, and reports
+// whether any did.
+func (e *Editor) filterCompletion(b *Buffer) bool {
+	_, prefix := completionWord(b)
+
+	type match struct {
+		item  CompletionItem
+		score int
+	}
+	var matches []match
+	for _, item := range e.completion.items {
+		text := item.FilterText
+		if text == "" {
+			text = item.Label
+		}
+		if score, ok := fuzzyMatch(prefix, text); ok {
+			matches = append(matches, match{item, score})
+		}
+	}
+
+	// Items that match equally well keep the server's order.
+	sort.SliceStable(matches, func(i, j int) bool {
+		return matches[i].score > matches[j].score
+	})
+
+	e.autocompleteItems = make([]CompletionItem, len(matches))
+	for i, m := range matches {
+		e.autocompleteItems[i] = m.item
+	}
 	e.autocompleteIndex = 0
 	e.autocompleteScroll = 0
-	e.showAutocomplete = true
-	e.message = ""
+	e.showAutocomplete = len(matches) > 0
+	return e.showAutocomplete
+}
+
+// completionWord returns the column where the word at the cursor starts and
+// the part of it before the cursor.
+func completionWord(b *Buffer) (int, string) {
+	cursor := b.PrimaryCursor()
+	line := b.line(cursor.Y)
+	start := min(cursor.X, len(line))
+	for start > 0 {
+		r := line[start-1]
+		if !((r >= 'a' && r <= 'z') || (r >= 'A' && r <= 'Z') || (r >= '0' && r <= '9') || r == '_') {
+			break
+		}
+		start--
+	}
+	return start, string(line[start:min(cursor.X, len(line))])
+}
+
+// postResult hands fn to the event loop and wakes it up. LSP answers and
+// file walk results arrive on other goroutines, so they touch the editor
+// only through fn.
+func (e *Editor) postResult(fn func()) {
+	e.results <- fn
+	termbox.Interrupt()
+}
+
+// cursorMoved reports whether the user has left the position a request was
+// made for, which makes its answer stale.
+func (e *Editor) cursorMoved(b *Buffer, cursor Cursor) bool {
+	if e.activeBuffer() != b {
+		return true
+	}
+	c := b.PrimaryCursor()
+	return c.X != cursor.X || c.Y != cursor.Y
 }
 
 func (e *Editor) drawAutocompletePopup() {
@@ -4418,7 +4518,7 @@ func (e *Editor) drawAutocompletePopup() {
 	}
 
 	// Calculate position (below cursor or above if no space)
-	visualCursorX := e.bufferToVisual(b.buffer[b.PrimaryCursor().Y], b.PrimaryCursor().X)
+	visualCursorX := e.bufferToVisual(b.line(b.PrimaryCursor().Y), b.PrimaryCursor().X)
 	cursorScreenX := visualCursorX - b.scrollX + Config.GutterWidth
 	cursorScreenY := b.PrimaryCursor().Y - b.scrollY
 
@@ -4480,17 +4580,10 @@ func (e *Editor) insertCompletion(item CompletionItem) {
 	}
 
 	cursor := b.PrimaryCursor()
-	line := b.buffer[cursor.Y]
+	line := b.line(cursor.Y)
 
 	// Find the start of the word we're completing
-	start := cursor.X
-	for start > 0 {
-		r := line[start-1]
-		if !((r >= 'a' && r <= 'z') || (r >= 'A' && r <= 'Z') || (r >= '0' && r <= '9') || r == '_') {
-			break
-		}
-		start--
-	}
+	start, _ := completionWord(b)
 
 	// Text to insert
 	insertText := item.InsertText
@@ -4520,14 +4613,20 @@ func (e *Editor) insertCompletion(item CompletionItem) {
 
 	newRuneLine = append(newRuneLine, line[cursor.X:]...)
 
-	b.buffer[cursor.Y] = newRuneLine
-	cursor.X = start + cursorOffset
+	b.setLine(cursor.Y, newRuneLine)
 
 	// Handle syntax update
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		removedBytes := b.getLineByteOffset(line, cursor.X) - b.getLineByteOffset(line, start)
+		insertedEnd := len(newRuneLine) - (len(line) - cursor.X)
+		insertedBytes := b.getLineByteOffset(newRuneLine, insertedEnd) - b.getLineByteOffset(newRuneLine, start)
+		b.handleEdit(cursor.Y, start, removedBytes, insertedBytes, cursor.Y, b.getLineByteOffset(line, cursor.X), cursor.Y, b.getLineByteOffset(newRuneLine, insertedEnd))
+		b.syntax.Reparse(b.snapshot())
 	}
 
+	cursor.X = start + cursorOffset
+
 	e.markModified()
 	e.showAutocomplete = false
+	e.completion = completionCache{}
 }
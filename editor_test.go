@@ -0,0 +1,81 @@
+package main
+
+import (
+	"os"
+	"path/filepath"
+	"testing"
+	"time"
+
+	"github.com/nsf/termbox-go"
+)
+
+// TestReloadBufferUndo checks that undo after a reload does not replay
+// changes made to the text from before the reload.
+func TestReloadBufferUndo(t *testing.T) {
+	Config.UndoMemory = 16
+	InitFileTypes()
+
+	filename := filepath.Join(t.TempDir(), "reload.txt")
+	if err := os.WriteFile(filename, []byte("one\ntwo\nthree\n"), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	e := NewEditor(false)
+	if err := e.LoadFile(filename); err != nil {
+		t.Fatal(err)
+	}
+	b := e.activeBuffer()
+
+	e.saveState()
+	b.PrimaryCursor().Y = 1
+	e.insertRune('x')
+	e.saveState()
+
+	if err := os.WriteFile(filename, []byte("alpha\n"), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	if err := e.ReloadBuffer(b); err != nil {
+		t.Fatal(err)
+	}
+	e.undo()
+
+	if got := b.snapshot().String(); got != "alpha" {
+		t.Errorf("text after undo = %q, want %q", got, "alpha")
+	}
+}
+
+// TestInterruptSkipsFileCheck checks that interrupts, which LSP answers and
+// diagnostics send all the time, do not stat the open files: only the check
+// posted by PeriodicFileChangesCheck reloads them.
+func TestInterruptSkipsFileCheck(t *testing.T) {
+	Config.UndoMemory = 16
+	InitFileTypes()
+
+	filename := filepath.Join(t.TempDir(), "check.txt")
+	if err := os.WriteFile(filename, []byte("old\n"), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	e := NewEditor(false)
+	if err := e.LoadFile(filename); err != nil {
+		t.Fatal(err)
+	}
+	b := e.activeBuffer()
+
+	if err := os.WriteFile(filename, []byte("new\n"), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	later := time.Now().Add(time.Minute)
+	if err := os.Chtimes(filename, later, later); err != nil {
+		t.Fatal(err)
+	}
+
+	e.handleEvent(termbox.Event{Type: termbox.EventInterrupt})
+	if got := b.snapshot().String(); got != "old" {
+		t.Fatalf("text after an interrupt = %q, want %q", got, "old")
+	}
+
+	e.results <- e.CheckFilesOnDisk
+	e.handleEvent(termbox.Event{Type: termbox.EventInterrupt})
+	if got := b.snapshot().String(); got != "new" {
+		t.Errorf("text after the file check = %q, want %q", got, "new")
+	}
+}
@@ -0,0 +1,165 @@
+package main
+
+// Undo and redo history of a buffer. Every undoable action is recorded as the
+// range of lines it replaced together with the old and new lines, rather than
+// as a copy of the whole buffer, and undoing it applies the change in reverse.
+
+import (
+	"slices"
+
+	sitter "github.com/mitjafelicijan/go-tree-sitter"
+)
+
+// HistoryState is an entry of the undo or redo stack. Applying it replaces
+// the lines after at row with the lines before and restores the cursors.
+type HistoryState struct {
+	row     int
+	before  []string
+	after   []string
+	cursors []Cursor
+}
+
+// historyMark is the state of a buffer at the start of an undoable action.
+type historyMark struct {
+	text    rope
+	cursors []Cursor
+}
+
+// size estimates the memory held by the entry.
+func (h *HistoryState) size() int {
+	n := len(h.cursors) * 24
+	for _, line := range h.before {
+		n += len(line) + 16
+	}
+	for _, line := range h.after {
+		n += len(line) + 16
+	}
+	return n
+}
+
+// beginAction starts an undoable action. Everything changed until the next
+// action or undo is recorded as one history entry.
+func (b *Buffer) beginAction() {
+	b.endAction()
+	b.mark = &historyMark{text: b.text, cursors: slices.Clone(b.cursors)}
+	b.redoStack = nil
+}
+
+// endAction records the changes made since beginAction, if there were any.
+// The text is a persistent rope, so the mark is only a reference to the old
+// version and the changed lines are found by comparing the two.
+func (b *Buffer) endAction() {
+	if b.mark == nil {
+		return
+	}
+	mark := b.mark
+	b.mark = nil
+
+	start, end, newEnd := mark.text.diff(b.text)
+	if start == end && start == newEnd {
+		return
+	}
+	b.pushUndo(HistoryState{
+		row:     start,
+		before:  mark.text.slice(start, end),
+		after:   b.text.slice(start, newEnd),
+		cursors: mark.cursors,
+	})
+}
+
+// pushUndo adds an entry to the undo stack and drops the oldest entries while
+// the stack is over the memory budget. The newest entry is always kept.
+func (b *Buffer) pushUndo(h HistoryState) {
+	b.undoStack = append(b.undoStack, h)
+	b.undoBytes += h.size()
+	budget := Config.UndoMemory << 20
+	for b.undoBytes > budget && len(b.undoStack) > 1 {
+		b.undoBytes -= b.undoStack[0].size()
+		b.undoStack[0] = HistoryState{}
+		b.undoStack = b.undoStack[1:]
+	}
+}
+
+// undo reverts the last action and reports whether there was one.
+func (b *Buffer) undo() bool {
+	b.endAction()
+	if len(b.undoStack) == 0 {
+		return false
+	}
+
+	h := b.undoStack[len(b.undoStack)-1]
+	b.undoStack = b.undoStack[:len(b.undoStack)-1]
+	b.undoBytes -= h.size()
+	b.redoStack = append(b.redoStack, b.applyHistory(h))
+	return true
+}
+
+// redo applies the last undone action again and reports whether there was
+// one.
+func (b *Buffer) redo() bool {
+	b.endAction()
+	if len(b.redoStack) == 0 {
+		return false
+	}
+
+	h := b.redoStack[len(b.redoStack)-1]
+	b.redoStack = b.redoStack[:len(b.redoStack)-1]
+	b.pushUndo(b.applyHistory(h))
+	return true
+}
+
+// clearHistory forgets all undo and redo entries.
+func (b *Buffer) clearHistory() {
+	b.undoStack = nil
+	b.redoStack = nil
+	b.undoBytes = 0
+	b.mark = nil
+}
+
+// applyHistory applies an entry to the buffer and returns the entry that
+// reverts it.
+func (b *Buffer) applyHistory(h HistoryState) HistoryState {
+	inverse := HistoryState{row: h.row, before: h.after, after: h.before, cursors: slices.Clone(b.cursors)}
+	b.replaceLines(h.row, len(h.after), h.before)
+	b.cursors = h.cursors
+	return inverse
+}
+
+// replaceLines replaces n lines starting at row with lines and reports the
+// change to the syntax tree as a single edit.
+func (b *Buffer) replaceLines(row, n int, lines []string) {
+	old := b.text
+	b.text = b.text.delete(row, row+n).insert(row, lines)
+	if b.syntax == nil {
+		return
+	}
+
+	// The text has no newline after the last line, so a change that reaches
+	// the end starts at the end of the line before it instead.
+	var edit sitter.EditInput
+	if row+n < old.len() && row+len(lines) < b.text.len() {
+		edit.StartIndex = old.lineStart(row)
+		edit.OldEndIndex = old.lineStart(row + n)
+		edit.NewEndIndex = b.text.lineStart(row + len(lines))
+		edit.StartPoint = sitter.Point{Row: uint32(row)}
+		edit.OldEndPoint = sitter.Point{Row: uint32(row + n)}
+		edit.NewEndPoint = sitter.Point{Row: uint32(row + len(lines))}
+	} else {
+		if row > 0 {
+			edit.StartIndex = old.lineStart(row) - 1
+			edit.StartPoint = sitter.Point{Row: uint32(row - 1), Column: uint32(len(old.line(row - 1)))}
+		}
+		edit.OldEndIndex, edit.OldEndPoint = ropeEnd(old)
+		edit.NewEndIndex, edit.NewEndPoint = ropeEnd(b.text)
+	}
+	b.syntax.Edit(edit)
+}
+
+// ropeEnd returns the byte offset and position of the end of the text of r.
+func ropeEnd(r rope) (uint32, sitter.Point) {
+	if r.len() == 0 {
+		return 0, sitter.Point{}
+	}
+	last := r.len() - 1
+	return r.bytes() - 1, sitter.Point{Row: uint32(last), Column: uint32(len(r.line(last)))}
+}
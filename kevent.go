@@ -5,65 +5,192 @@ package main
 // etc.).
 
 import (
+	"slices"
+	"time"
+
 	"github.com/nsf/termbox-go"
 )
 
+// eventQueueSize is how many events an eventReader can read ahead of the
+// editor.
+const eventQueueSize = 1024
+
+// maxBatchTime is how long HandleEvents handles events that have already
+// arrived before it redraws, so the screen keeps up with a continuous stream
+// of input. It is about one frame.
+const maxBatchTime = 16 * time.Millisecond
+
 // HandleEvents is the central loop that waits for and processes all user input.
+// All events that have already arrived are handled before the screen is
+// redrawn, up to maxBatchTime, so a paste or a burst of keys costs one redraw
+// and one parse instead of one per key.
 func (e *Editor) HandleEvents() {
+	events := newEventReader()
+
 	for {
 		// Redraw the screen before waiting for the next event.
 		e.draw()
-		ev := termbox.PollEvent()
+		ev := events.next()
 
-		// Handle interrupt events (triggered by diagnostic updates).
-		// Fetch latest diagnostics from LSP client.
-		if ev.Type == termbox.EventInterrupt {
-			b := e.activeBuffer()
-			if b != nil && b.lspClient != nil {
-				b.diagnostics = b.lspClient.GetDiagnostics()
+		held := e.holdSyntax()
+		start := time.Now()
+		for {
+			if keys, pasted := events.readPaste(ev); pasted {
+				e.paste(keys)
+			} else if !e.handleEvent(ev) {
+				return
 			}
-			e.CheckFilesOnDisk()
-			continue
-		}
 
-		if ev.Type == termbox.EventKey {
-			// Clear message on any key press unless specifically set.
-			e.message = ""
-			// Hide hover popup if any key other than Ctrl+K is pressed.
-			if e.showHover && ev.Key != termbox.KeyCtrlK {
-				e.showHover = false
+			if time.Since(start) >= maxBatchTime {
+				break
 			}
-
-			// If dev mode, exit the editor with Ctrl+C.
-			if ev.Key == termbox.KeyCtrlC && e.devMode {
-				return
+			var ok bool
+			if ev, ok = events.poll(0); !ok {
+				break
 			}
+		}
+		for _, s := range held {
+			s.Release()
+		}
+	}
+}
 
-			// Dispatch the key event to the handler for the current editor mode.
-			switch e.mode {
-			case ModeNormal:
-				e.handleNormalMode(ev)
-			case ModeInsert:
-				e.handleInsertMode(ev)
-			case ModeCommand:
-				e.handleCommandMode(ev)
-			case ModeFuzzy:
-				e.handleFuzzyMode(ev)
-			case ModeFind:
-				e.handleFindMode(ev)
-			case ModeVisual:
-				e.handleVisualMode(ev)
-			case ModeVisualLine:
-				e.handleVisualLineMode(ev)
-			case ModeVisualBlock:
-				e.handleVisualBlockMode(ev)
-			case ModeReplace:
-				e.handleReplaceMode(ev)
-			case ModeConfirm:
-				e.handleConfirmMode(ev)
-			}
-		} else if ev.Type == termbox.EventMouse {
-			e.handleMouseEvent(ev)
+// eventReader reads terminal events on its own goroutine, so the editor can
+// tell which events have already arrived. Events can be put back, which lets
+// sequences that span several events be recognized.
+type eventReader struct {
+	events chan termbox.Event
+	ahead  []termbox.Event // Events put back by unread, returned first.
+}
+
+func newEventReader() *eventReader {
+	r := &eventReader{events: make(chan termbox.Event, eventQueueSize)}
+	go func() {
+		for {
+			r.events <- termbox.PollEvent()
+		}
+	}()
+	return r
+}
+
+// next waits for the next event.
+func (r *eventReader) next() termbox.Event {
+	if ev, ok := r.poll(0); ok {
+		return ev
+	}
+	return <-r.events
+}
+
+// poll returns the next event if one arrives within timeout. A timeout of 0
+// only takes an event that has already arrived.
+func (r *eventReader) poll(timeout time.Duration) (termbox.Event, bool) {
+	if len(r.ahead) > 0 {
+		ev := r.ahead[0]
+		r.ahead = r.ahead[1:]
+		return ev, true
+	}
+
+	select {
+	case ev := <-r.events:
+		return ev, true
+	default:
+	}
+	if timeout <= 0 {
+		return termbox.Event{}, false
+	}
+
+	timer := time.NewTimer(timeout)
+	defer timer.Stop()
+	select {
+	case ev := <-r.events:
+		return ev, true
+	case <-timer.C:
+		return termbox.Event{}, false
+	}
+}
+
+// unread puts events back to be returned before any other.
+func (r *eventReader) unread(events ...termbox.Event) {
+	r.ahead = append(slices.Clip(events), r.ahead...)
+}
+
+// holdSyntax holds parsing in all buffers until the current batch of events
+// is handled, see SyntaxHighlighter.Hold, and returns the held highlighters.
+func (e *Editor) holdSyntax() []*SyntaxHighlighter {
+	var held []*SyntaxHighlighter
+	for _, b := range e.buffers {
+		if b.syntax != nil {
+			b.syntax.Hold()
+			held = append(held, b.syntax)
+		}
+	}
+	return held
+}
+
+// handleEvent processes one event. It returns false if the editor should
+// exit.
+func (e *Editor) handleEvent(ev termbox.Event) bool {
+	// Handle interrupt events (triggered by diagnostic updates, LSP
+	// answers, the file walk and the file check). Apply the queued results
+	// and fetch the latest diagnostics.
+	if ev.Type == termbox.EventInterrupt {
+		e.applyResults()
+		if b := e.activeBuffer(); b != nil {
+			b.refreshDiagnostics()
+		}
+		return true
+	}
+
+	if ev.Type == termbox.EventKey {
+		// Clear message on any key press unless specifically set.
+		e.message = ""
+		// Hide hover popup if any key other than Ctrl+K is pressed.
+		if e.showHover && ev.Key != termbox.KeyCtrlK {
+			e.showHover = false
+		}
+
+		// If dev mode, exit the editor with Ctrl+C.
+		if ev.Key == termbox.KeyCtrlC && e.devMode {
+			return false
+		}
+
+		// Dispatch the key event to the handler for the current editor mode.
+		switch e.mode {
+		case ModeNormal:
+			e.handleNormalMode(ev)
+		case ModeInsert:
+			e.handleInsertMode(ev)
+		case ModeCommand:
+			e.handleCommandMode(ev)
+		case ModeFuzzy:
+			e.handleFuzzyMode(ev)
+		case ModeFind:
+			e.handleFindMode(ev)
+		case ModeVisual:
+			e.handleVisualMode(ev)
+		case ModeVisualLine:
+			e.handleVisualLineMode(ev)
+		case ModeVisualBlock:
+			e.handleVisualBlockMode(ev)
+		case ModeReplace:
+			e.handleReplaceMode(ev)
+		case ModeConfirm:
+			e.handleConfirmMode(ev)
+		}
+	} else if ev.Type == termbox.EventMouse {
+		e.handleMouseEvent(ev)
+	}
+	return true
+}
+
+// applyResults runs the work queued by postResult.
+func (e *Editor) applyResults() {
+	for {
+		select {
+		case fn := <-e.results:
+			fn()
+		default:
+			return
 		}
 	}
 }
@@ -444,6 +571,7 @@ func (e *Editor) handleInsertMode(ev termbox.Event) {
 			return
 		case termbox.KeyEsc:
 			e.showAutocomplete = false
+			e.completion = completionCache{}
 			return
 		}
 	}
@@ -452,15 +580,20 @@ func (e *Editor) handleInsertMode(ev termbox.Event) {
 	case termbox.KeyEsc:
 		// Return to Normal mode and trigger a diagnostic check.
 		e.mode = ModeNormal
+		e.completion = completionCache{}
 		e.checkDiagnostics()
 	case termbox.KeyEnter:
 		e.insertNewline()
 	case termbox.KeySpace:
 		e.insertRune(' ')
+		if e.showAutocomplete {
+			e.showAutocomplete = false
+		}
 	case termbox.KeyBackspace, termbox.KeyBackspace2:
 		e.backspace()
+		// Narrow the completions to the shorter word.
 		if e.showAutocomplete {
-			e.showAutocomplete = false
+			e.refineCompletion()
 		}
 	case termbox.KeyTab:
 		e.insertTab()
@@ -495,9 +628,9 @@ func (e *Editor) handleInsertMode(ev termbox.Event) {
 		// If a character key was pressed, insert the character.
 		if ev.Ch != 0 {
 			e.insertRune(ev.Ch)
-			// Close autocomplete if user keeps typing.
+			// Narrow the completions to the word typed so far.
 			if e.showAutocomplete {
-				e.showAutocomplete = false
+				e.refineCompletion()
 			}
 		}
 	}
@@ -564,6 +697,13 @@ func (e *Editor) handleCommandMode(ev termbox.Event) {
 
 // handleFuzzyMode processes input for the fuzzy finder (files or buffers).
 func (e *Editor) handleFuzzyMode(ev termbox.Event) {
+	// A file walk is only needed while its finder is open.
+	defer func() {
+		if e.mode != ModeFuzzy {
+			e.cancelFileWalk()
+		}
+	}()
+
 	switch ev.Key {
 	case termbox.KeyEsc:
 		e.mode = ModeNormal
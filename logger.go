@@ -0,0 +1,128 @@
+package main
+
+// Debug log of the editor. The most recent lines are kept in memory for the
+// Log window and, with -log, every line is appended to Config.LogFilePath by
+// a background goroutine, so logging never waits for the disk. Lines can be
+// added from any goroutine.
+
+import (
+	"bufio"
+	"fmt"
+	"os"
+	"sync"
+)
+
+// logQueueSize is how many lines can wait for the file writer. Lines logged
+// while the queue is full are dropped and counted in the file.
+const logQueueSize = 4096
+
+// logger is a ring buffer of log lines with an optional file writer.
+type logger struct {
+	mu      sync.Mutex
+	lines   []string    // Ring buffer of the most recent lines.
+	next    int         // Index in lines where the next line goes.
+	count   int         // Number of lines in the ring buffer.
+	pending chan string // Lines waiting for the file writer, nil without a file.
+	dropped int         // Lines not queued because pending was full.
+	closed  bool        // Set by Close; no more lines are queued.
+	done    chan struct{}
+}
+
+// newLogger returns a logger that keeps the last capacity lines and, if path
+// is not empty, appends all lines to the file at path.
+func newLogger(capacity int, path string) *logger {
+	l := &logger{lines: make([]string, capacity)}
+	if path != "" {
+		l.pending = make(chan string, logQueueSize)
+		l.done = make(chan struct{})
+		go l.write(path)
+	}
+	return l
+}
+
+// add appends a line to the log.
+func (l *logger) add(line string) {
+	l.mu.Lock()
+	defer l.mu.Unlock()
+
+	l.lines[l.next] = line
+	l.next = (l.next + 1) % len(l.lines)
+	l.count = min(l.count+1, len(l.lines))
+
+	if l.pending != nil && !l.closed {
+		select {
+		case l.pending <- line:
+		default:
+			l.dropped++
+		}
+	}
+}
+
+// recent returns up to n of the most recent lines, oldest first.
+func (l *logger) recent(n int) []string {
+	l.mu.Lock()
+	defer l.mu.Unlock()
+
+	n = min(n, l.count)
+	result := make([]string, n)
+	start := l.next - n + len(l.lines)
+	for i := range result {
+		result[i] = l.lines[(start+i)%len(l.lines)]
+	}
+	return result
+}
+
+// write appends the queued lines to the file at path. Whatever is queued by
+// the time it wakes up is written with one flush.
+func (l *logger) write(path string) {
+	defer close(l.done)
+
+	f, err := os.OpenFile(path, os.O_APPEND|os.O_CREATE|os.O_WRONLY, 0644)
+	if err != nil {
+		for range l.pending {
+		}
+		return
+	}
+	defer f.Close()
+
+	w := bufio.NewWriter(f)
+	for line := range l.pending {
+		w.WriteString(line + "\n")
+		for batch := true; batch; {
+			select {
+			case line, ok := <-l.pending:
+				if ok {
+					w.WriteString(line + "\n")
+				} else {
+					batch = false
+				}
+			default:
+				batch = false
+			}
+		}
+
+		l.mu.Lock()
+		dropped := l.dropped
+		l.dropped = 0
+		l.mu.Unlock()
+		if dropped > 0 {
+			fmt.Fprintf(w, "[log] %d lines dropped\n", dropped)
+		}
+		w.Flush()
+	}
+}
+
+// Close writes the lines still queued to the file and stops the writer.
+func (l *logger) Close() {
+	if l.pending == nil {
+		return
+	}
+
+	l.mu.Lock()
+	if !l.closed {
+		l.closed = true
+		close(l.pending)
+	}
+	l.mu.Unlock()
+	<-l.done
+}
@@ -2,42 +2,183 @@ package main
 
 // Basic Language Server Protocol (LSP) client. Communicates with external
 // language servers (like gopls or clangd) via JSON-RPC over standard
-// input/output.
+// input/output. Documents of the same workspace that use the same server
+// command share one server process.
 
 import (
 	"bufio"
+	"bytes"
 	"encoding/json"
 	"fmt"
 	"io"
 	"os"
 	"os/exec"
 	"path/filepath"
+	"strconv"
 	"strings"
 	"sync"
 	"sync/atomic"
 	"time"
+	"unicode/utf8"
 
 	"github.com/nsf/termbox-go"
 )
 
-// LSPClient manages the lifecycle and communication with an LSP server process.
-type LSPClient struct {
+// lspServer manages the lifecycle and communication with an LSP server
+// process.
+type lspServer struct {
+	key          lspServerKey   // Entry of the server in lspServers.
 	cmd          *exec.Cmd      // The underlying server process.
 	stdin        io.WriteCloser // Write messages to the server.
 	stdout       io.ReadCloser  // Read messages from the server.
-	scanner      *bufio.Scanner
-	messageID    int64        // Monotonically increasing ID for requests.
-	diagnostics  []Diagnostic // Cached errors/warnings from the server.
-	diagMutex    sync.RWMutex // Protects access to diagnostics.
-	filename     string       // The file this client is associated with.
-	uri          string       // The LSP-compatible URI of the file.
-	shutdown     bool         // Flag to indicate the client is closing.
+	messageID    int64          // Monotonically increasing ID for requests.
+	shutdown     atomic.Bool    // Flag to indicate the server is closing.
 	shutdownOnce sync.Once
 	logCallback  func(string, string) // Debug logging.
 
-	responses     map[int64]chan map[string]interface{} // Map of request IDs to response channels.
+	responses     map[int64]chan *rpcMessage // Map of request IDs to response channels.
+	pending       map[string]int64           // Latest request ID of each method still waiting, see call.
 	responseMutex sync.Mutex
-	fileType      *FileType // Associated file type for language ID.
+	syncKind      int32 // How the server wants changes sent, see syncFull. Accessed atomically.
+	encoding      int32 // How the server counts characters, see positionEncoding. Accessed atomically.
+
+	// Messages are written to stdin by writeMessages, in the order they
+	// were sent, so sending never waits for the server to read.
+	outbox      [][]byte      // Encoded messages waiting to be written.
+	outboxMutex sync.Mutex    // Protects outbox, held, initialized and closing.
+	outboxReady chan struct{} // Wakes writeMessages, see sendMessage.
+	held        [][]byte      // Messages sent before initialized, see initialize.
+	initialized bool          // The server has answered initialize.
+	closing     bool          // Set by Shutdown; stdin is closed once outbox is written.
+
+	docs      map[string]*LSPClient // Open documents by URI.
+	docsMutex sync.Mutex            // Protects docs and their reference counts.
+}
+
+// lspServerKey identifies a server that documents can share: the command that
+// runs it and the workspace it was started for.
+type lspServerKey struct {
+	command string
+	root    string
+}
+
+// lspServers holds the running servers. The lock also serializes opening and
+// closing documents, so a server is never shut down while a document is
+// being opened in it.
+var (
+	lspServers      = map[lspServerKey]*lspServer{}
+	lspServersMutex sync.Mutex
+)
+
+// workspaceMarkers are files that mark the root directory of a workspace.
+var workspaceMarkers = []string{".git", "go.mod", "compile_commands.json"}
+
+// LSPClient is a document open in a language server. Buffers showing the same
+// file share one.
+type LSPClient struct {
+	server      *lspServer
+	diagnostics []Diagnostic         // Cached errors/warnings from the server.
+	diagVersion int64                // Changes with every new set of diagnostics.
+	diagMutex   sync.RWMutex         // Protects access to diagnostics.
+	filename    string               // The file this client is associated with.
+	uri         string               // The LSP-compatible URI of the file.
+	refs        int                  // Number of buffers using the document.
+	logCallback func(string, string) // Debug logging.
+	fileType    *FileType            // Associated file type for language ID.
+
+	// Document sync state, see Update and Flush.
+	syncMutex sync.Mutex
+	synced    rope        // Text the server has.
+	latest    rope        // Text of the buffer at the last Update.
+	dirty     bool        // latest has not been sent yet.
+	version   int         // Version of synced; didOpen sends version 1.
+	syncTimer *time.Timer // Flushes once edits have paused.
+}
+
+// Document sync kinds a server announces in its initialize result.
+const (
+	syncNone        = 0 // Changes are not sent.
+	syncFull        = 1 // Every change sends the whole document.
+	syncIncremental = 2 // Changes send only the modified range.
+)
+
+// positionEncoding is the unit in which a server counts the character offset
+// of a position. The server picks one of the encodings the client offers;
+// UTF-16 is the default for servers that do not.
+type positionEncoding int32
+
+const (
+	encodingUTF16 positionEncoding = iota
+	encodingUTF8
+	encodingUTF32
+)
+
+// positionEncodings maps the protocol's names of the encodings to them.
+var positionEncodings = map[string]positionEncoding{
+	"utf-8":  encodingUTF8,
+	"utf-16": encodingUTF16,
+	"utf-32": encodingUTF32,
+}
+
+// length returns the number of code units of s.
+func (enc positionEncoding) length(s string) int {
+	switch enc {
+	case encodingUTF8:
+		return len(s)
+	case encodingUTF32:
+		return utf8.RuneCountInString(s)
+	}
+
+	n := 0
+	for _, r := range s {
+		n++
+		if r >= 0x10000 {
+			n++ // Encoded as a surrogate pair.
+		}
+	}
+	return n
+}
+
+// advance returns the position reached by moving over text from p.
+func (enc positionEncoding) advance(p Position, text string) Position {
+	if i := strings.LastIndexByte(text, '\n'); i >= 0 {
+		p.Line += strings.Count(text, "\n")
+		p.Character = 0
+		text = text[i+1:]
+	}
+	p.Character += enc.length(text)
+	return p
+}
+
+// rpcMessage is the envelope of a JSON-RPC message from the server. Only the
+// envelope is decoded when the message is read; params and result are kept
+// raw and decoded straight into the structs of whoever handles them.
+type rpcMessage struct {
+	ID     json.RawMessage `json:"id"`
+	Method string          `json:"method"`
+	Params json.RawMessage `json:"params"`
+	Result json.RawMessage `json:"result"`
+	Error  *rpcError       `json:"error"`
+}
+
+// rpcError is the error of a failed request.
+type rpcError struct {
+	Code    int    `json:"code"`
+	Message string `json:"message"`
+}
+
+func (e *rpcError) Error() string {
+	return fmt.Sprintf("LSP error %d: %s", e.Code, e.Message)
+}
+
+// isNull reports whether a raw JSON value is missing or null.
+func isNull(raw json.RawMessage) bool {
+	return len(raw) == 0 || string(raw) == "null"
+}
+
+// isArray reports whether a raw JSON value is an array.
+func isArray(raw json.RawMessage) bool {
+	return len(raw) > 0 && raw[0] == '['
 }
 
 // Position in a document (0-based line and character).
@@ -52,6 +193,12 @@ type Range struct {
 	End   Position `json:"end"`
 }
 
+// TextChange replaces a range of a document with new text.
+type TextChange struct {
+	Range Range  `json:"range"`
+	Text  string `json:"text"`
+}
+
 // Location points to a specific range in a specific file.
 type Location struct {
 	URI   string `json:"uri"`
@@ -65,6 +212,7 @@ type CompletionItem struct {
 	Detail        string `json:"detail"`
 	Documentation string `json:"documentation"`
 	InsertText    string `json:"insertText"`
+	FilterText    string `json:"filterText"` // Text to match against instead of the label.
 }
 
 // CompletionList represents a collection of completion items.
@@ -89,225 +237,363 @@ type Diagnostic struct {
 	Message  string `json:"message"`
 }
 
-// NewLSPClient starts a new LSP server process for the given file type.
-func NewLSPClient(filename string, fileContent string, logCallback func(string, string), ft *FileType) (*LSPClient, error) {
+// NewLSPClient opens text in the language server for the given file type,
+// starting the server unless one is already running for the workspace of the
+// file.
+func NewLSPClient(filename string, text rope, logCallback func(string, string), ft *FileType) (*LSPClient, error) {
 	absPath, err := filepath.Abs(filename)
 	if err != nil {
 		return nil, err
 	}
+	uri := "file://" + absPath
+
+	lspServersMutex.Lock()
+	defer lspServersMutex.Unlock()
+
+	key := lspServerKey{
+		command: strings.Join(append([]string{ft.LSPCommand}, ft.LSPCommandArgs...), " "),
+		root:    workspaceRoot(absPath),
+	}
+	server := lspServers[key]
+	if server == nil {
+		server, err = startLSPServer(key, ft, logCallback)
+		if err != nil {
+			return nil, err
+		}
+		lspServers[key] = server
+	}
 
-	client := &LSPClient{
+	server.docsMutex.Lock()
+	client := server.docs[uri]
+	if client != nil {
+		client.refs++
+	}
+	server.docsMutex.Unlock()
+	if client != nil {
+		return client, nil
+	}
+
+	client = &LSPClient{
+		server:      server,
 		filename:    absPath,
-		uri:         "file://" + absPath,
+		uri:         uri,
+		refs:        1,
 		diagnostics: []Diagnostic{},
 		logCallback: logCallback,
-		responses:   make(map[int64]chan map[string]interface{}),
 		fileType:    ft,
+		synced:      text,
+		latest:      text,
+		version:     1,
+	}
+	if err := client.sendDidOpen(text.String()); err != nil {
+		server.release()
+		return nil, err
+	}
+
+	server.docsMutex.Lock()
+	server.docs[uri] = client
+	server.docsMutex.Unlock()
+	return client, nil
+}
+
+// startLSPServer launches a language server and initializes it for the
+// workspace of key.
+func startLSPServer(key lspServerKey, ft *FileType, logCallback func(string, string)) (*lspServer, error) {
+	server := &lspServer{
+		key:         key,
+		logCallback: logCallback,
+		responses:   make(map[int64]chan *rpcMessage),
+		pending:     make(map[string]int64),
+		syncKind:    syncFull, // Until the server says otherwise.
+		docs:        make(map[string]*LSPClient),
+		outboxReady: make(chan struct{}, 1),
 	}
 
 	// Launch the language server's executable.
-	client.cmd = exec.Command(ft.LSPCommand, ft.LSPCommandArgs...)
+	server.cmd = exec.Command(ft.LSPCommand, ft.LSPCommandArgs...)
 
 	// Suppress the server's own internal log messages (stderr).
 	devNull, err := os.OpenFile(os.DevNull, os.O_WRONLY, 0)
 	if err == nil {
-		client.cmd.Stderr = devNull
+		server.cmd.Stderr = devNull
 	}
 
-	client.stdin, err = client.cmd.StdinPipe()
+	server.stdin, err = server.cmd.StdinPipe()
 	if err != nil {
 		return nil, err
 	}
 
-	client.stdout, err = client.cmd.StdoutPipe()
+	server.stdout, err = server.cmd.StdoutPipe()
 	if err != nil {
 		return nil, err
 	}
 
-	if err := client.cmd.Start(); err != nil {
+	if err := server.cmd.Start(); err != nil {
 		return nil, err
 	}
 
-	// Start a background goroutine to read messages from the server's stdout.
-	go client.readMessages()
+	// Start background goroutines to read messages from the server's stdout
+	// and write them to its stdin.
+	go server.readMessages()
+	go server.writeMessages()
 
-	// Perform the LSP handshake: Initialize and Notify Open.
-	if err := client.initialize(); err != nil {
-		client.Shutdown()
+	// Perform the LSP handshake.
+	if err := server.initialize(); err != nil {
+		server.Shutdown()
 		return nil, err
 	}
 
-	if err := client.sendDidOpen(fileContent); err != nil {
-		client.Shutdown()
-		return nil, err
+	if logCallback != nil {
+		logCallback("LSP", fmt.Sprintf("Started %s for %s", key.command, key.root))
 	}
+	return server, nil
+}
 
-	return client, nil
+// workspaceRoot returns the closest directory above path that contains one of
+// workspaceMarkers, or the directory of path if there is none.
+func workspaceRoot(path string) string {
+	dir := filepath.Dir(path)
+	for d := dir; ; d = filepath.Dir(d) {
+		for _, marker := range workspaceMarkers {
+			if _, err := os.Stat(filepath.Join(d, marker)); err == nil {
+				return d
+			}
+		}
+		if filepath.Dir(d) == d {
+			return dir
+		}
+	}
+}
+
+// release shuts the server down if no documents are open in it. The caller
+// must hold lspServersMutex.
+func (s *lspServer) release() {
+	s.docsMutex.Lock()
+	unused := len(s.docs) == 0
+	s.docsMutex.Unlock()
+	if !unused {
+		return
+	}
+
+	if lspServers[s.key] == s {
+		delete(lspServers, s.key)
+	}
+	go s.Shutdown()
 }
 
 // nextID increments and returns the next request ID.
-func (c *LSPClient) nextID() int64 {
-	return atomic.AddInt64(&c.messageID, 1)
+func (s *lspServer) nextID() int64 {
+	return atomic.AddInt64(&s.messageID, 1)
 }
 
 // sendRequest sends a JSON-RPC request and expects a response.
-func (c *LSPClient) sendRequest(method string, params interface{}) error {
-	id := c.nextID()
+func (s *lspServer) sendRequest(method string, params interface{}) error {
+	id := s.nextID()
 	request := map[string]interface{}{
 		"jsonrpc": "2.0",
 		"id":      id,
 		"method":  method,
 		"params":  params,
 	}
-	return c.sendMessage(request)
+	return s.sendMessage(request)
 }
 
 // sendNotification sends a JSON-RPC message without expecting a response.
-func (c *LSPClient) sendNotification(method string, params interface{}) error {
+func (s *lspServer) sendNotification(method string, params interface{}) error {
 	notification := map[string]interface{}{
 		"jsonrpc": "2.0",
 		"method":  method,
 		"params":  params,
 	}
-	return c.sendMessage(notification)
+	return s.sendMessage(notification)
 }
 
-// sendMessage writes a JSON-encoded message to the server's stdin.
-func (c *LSPClient) sendMessage(msg interface{}) error {
-	if c.shutdown {
+// sendMessage queues a JSON-encoded message for the server's stdin. It does
+// not wait for the message to be written. Until the server has answered
+// initialize, messages are held back, see initialize.
+func (s *lspServer) sendMessage(msg interface{}) error {
+	return s.queueMessage(msg, false)
+}
+
+// queueMessage queues msg for writeMessages, or holds it back until the
+// server is initialized unless early is set.
+func (s *lspServer) queueMessage(msg interface{}, early bool) error {
+	if s.shutdown.Load() {
 		return fmt.Errorf("client is shutdown")
 	}
 
-	data, err := json.Marshal(msg)
+	content, err := encodeMessage(msg)
 	if err != nil {
 		return err
 	}
 
-	// LSP messages use a header similar to HTTP: Content-Length followed by \r\n\r\n.
-	content := fmt.Sprintf("Content-Length: %d\r\n\r\n%s", len(data), data)
-	_, err = c.stdin.Write([]byte(content))
-	return err
+	s.outboxMutex.Lock()
+	if s.closing {
+		s.outboxMutex.Unlock()
+		return fmt.Errorf("client is shutdown")
+	}
+	if !s.initialized && !early {
+		s.held = append(s.held, content)
+		s.outboxMutex.Unlock()
+		return nil
+	}
+	s.outbox = append(s.outbox, content)
+	s.outboxMutex.Unlock()
+	s.wakeWriter()
+	return nil
+}
+
+// encodeMessage encodes msg with its header. LSP messages use a header
+// similar to HTTP: Content-Length followed by \r\n\r\n.
+func encodeMessage(msg interface{}) ([]byte, error) {
+	data, err := json.Marshal(msg)
+	if err != nil {
+		return nil, err
+	}
+	return fmt.Appendf(nil, "Content-Length: %d\r\n\r\n%s", len(data), data), nil
+}
+
+// wakeWriter tells writeMessages that there is something to do.
+func (s *lspServer) wakeWriter() {
+	select {
+	case s.outboxReady <- struct{}{}:
+	default: // writeMessages is already woken.
+	}
+}
+
+// writeMessages writes the queued messages to the server's stdin until
+// Shutdown, then closes it. Messages queued after a failed write are
+// dropped.
+func (s *lspServer) writeMessages() {
+	var failed bool
+	for range s.outboxReady {
+		s.outboxMutex.Lock()
+		messages := s.outbox
+		s.outbox = nil
+		closing := s.closing
+		s.outboxMutex.Unlock()
+
+		for _, msg := range messages {
+			if failed {
+				break
+			}
+			if _, err := s.stdin.Write(msg); err != nil {
+				failed = true
+				if s.logCallback != nil && !closing {
+					s.logCallback("LSP", fmt.Sprintf("Write error: %v", err))
+				}
+			}
+		}
+
+		if closing {
+			s.stdin.Close()
+			return
+		}
+	}
 }
 
 // readMessages loops forever, parsing messages from the server's stdout.
-func (c *LSPClient) readMessages() {
-	reader := bufio.NewReader(c.stdout)
+func (s *lspServer) readMessages() {
+	reader := bufio.NewReader(s.stdout)
+	var buf []byte
 
 	for {
-		if c.shutdown {
+		if s.shutdown.Load() {
 			return
 		}
 
 		// Parse the Content-Length header to know how many bytes to read next.
 		contentLength := 0
 		for {
-			line, err := reader.ReadString('\n')
+			line, err := reader.ReadSlice('\n')
 			if err != nil {
 				return
 			}
 
-			line = strings.TrimSpace(line)
-			if line == "" {
+			line = bytes.TrimSpace(line)
+			if len(line) == 0 {
 				break
 			}
 
-			var length int
-			if n, _ := fmt.Sscanf(line, "Content-Length: %d", &length); n == 1 {
-				contentLength = length
+			if value, ok := bytes.CutPrefix(line, []byte("Content-Length:")); ok {
+				contentLength, _ = strconv.Atoi(string(bytes.TrimSpace(value)))
 			}
 		}
 
-		if contentLength == 0 {
+		if contentLength <= 0 {
 			continue
 		}
 
-		// Read the JSON body.
-		buf := make([]byte, contentLength)
-		_, err := io.ReadFull(reader, buf)
-		if err != nil {
+		// Read the JSON body. Decoding copies the raw parts out of it, so the
+		// buffer is reused for the next message.
+		if cap(buf) < contentLength {
+			buf = make([]byte, contentLength)
+		}
+		buf = buf[:contentLength]
+		if _, err := io.ReadFull(reader, buf); err != nil {
 			return
 		}
 
-		var msg map[string]interface{}
-		if err := json.Unmarshal(buf, &msg); err != nil {
+		msg := &rpcMessage{}
+		if err := json.Unmarshal(buf, msg); err != nil {
 			continue
 		}
 
-		// If the message has an "id", it's a response to a request we sent.
-		if idVal, hasID := msg["id"]; hasID {
-			if c.logCallback != nil {
-				c.logCallback("LSP", fmt.Sprintf("Received response with ID: %v (type: %T)", idVal, idVal))
-			}
-			if id, ok := idVal.(float64); ok {
-				idInt := int64(id)
-				if c.logCallback != nil {
-					c.logCallback("LSP", fmt.Sprintf("Looking for response channel with ID=%d", idInt))
-				}
-				c.responseMutex.Lock()
-				ch, exists := c.responses[idInt]
-				if exists {
-					if c.logCallback != nil {
-						c.logCallback("LSP", fmt.Sprintf("Found channel for ID=%d, sending response", idInt))
-					}
-					delete(c.responses, idInt)
-					c.responseMutex.Unlock()
-					ch <- msg // Send response to the goroutine waiting for it.
-				} else {
-					if c.logCallback != nil {
-						c.logCallback("LSP", fmt.Sprintf("No channel found for ID=%d", idInt))
-					}
-					c.responseMutex.Unlock()
-				}
-			} else {
-				if c.logCallback != nil {
-					c.logCallback("LSP", fmt.Sprintf("Failed to convert ID to int64: %v", idVal))
-				}
+		// If it has no "id", it's an asynchronous notification (like updated diagnostics).
+		if isNull(msg.ID) {
+			s.handleNotification(msg)
+			continue
+		}
+
+		// Requests from the server are not supported.
+		if msg.Method != "" {
+			continue
+		}
+
+		// Otherwise it's a response to a request we sent.
+		id, err := strconv.ParseInt(string(msg.ID), 10, 64)
+		if err != nil {
+			if s.logCallback != nil {
+				s.logCallback("LSP", fmt.Sprintf("Ignoring message with ID %s", msg.ID))
 			}
+			continue
 		}
 
-		// If it has no "id", it's an asynchronous notification (like updated diagnostics).
-		if _, hasID := msg["id"]; !hasID {
-			c.handleNotification(msg)
+		s.responseMutex.Lock()
+		ch, exists := s.responses[id]
+		delete(s.responses, id)
+		s.responseMutex.Unlock()
+
+		if exists {
+			ch <- msg // Send response to the goroutine waiting for it.
+		} else if s.logCallback != nil {
+			s.logCallback("LSP", fmt.Sprintf("No channel found for ID=%d", id))
 		}
 	}
 }
 
 // handleNotification processes messages initiated by the server.
-func (c *LSPClient) handleNotification(msg map[string]interface{}) {
-	method, ok := msg["method"].(string)
-	if !ok {
-		return
-	}
-
+func (s *lspServer) handleNotification(msg *rpcMessage) {
 	// Server is sending updated errors/warnings for the file.
-	if method == "textDocument/publishDiagnostics" {
-		params, ok := msg["params"].(map[string]interface{})
-		if !ok {
-			return
-		}
-
-		uri, _ := params["uri"].(string)
-		if uri != c.uri {
-			return
+	if msg.Method == "textDocument/publishDiagnostics" {
+		var params struct {
+			URI         string       `json:"uri"`
+			Diagnostics []Diagnostic `json:"diagnostics"`
 		}
+		json.Unmarshal(msg.Params, &params)
 
-		diagsRaw, ok := params["diagnostics"].([]interface{})
-		if !ok {
+		// Route the diagnostics to the document they are for.
+		s.docsMutex.Lock()
+		doc := s.docs[params.URI]
+		s.docsMutex.Unlock()
+		if doc == nil {
 			return
 		}
 
-		var diags []Diagnostic
-		for _, d := range diagsRaw {
-			diagJSON, _ := json.Marshal(d)
-			var diag Diagnostic
-			if json.Unmarshal(diagJSON, &diag) == nil {
-				diags = append(diags, diag)
-			}
-		}
-
-		c.diagMutex.Lock()
-		c.diagnostics = diags
-		c.diagMutex.Unlock()
+		doc.diagMutex.Lock()
+		doc.diagnostics = params.Diagnostics
+		doc.diagVersion = nextDiagnosticsVersion()
+		doc.diagMutex.Unlock()
 
 		// Tell termbox to refresh the UI so signs appear in the gutter.
 		termbox.Interrupt()
@@ -315,12 +601,16 @@ func (c *LSPClient) handleNotification(msg map[string]interface{}) {
 }
 
 // initialize sends the initial 'initialize' request to the server.
-func (c *LSPClient) initialize() error {
-	rootURI := "file://" + filepath.Dir(c.filename)
+func (s *lspServer) initialize() error {
+	rootURI := "file://" + s.key.root
 	params := map[string]interface{}{
 		"processId": os.Getpid(),
 		"rootUri":   rootURI,
 		"capabilities": map[string]interface{}{
+			"general": map[string]interface{}{
+				// UTF-8 matches the buffer, so positions need no conversion.
+				"positionEncodings": []string{"utf-8", "utf-16"},
+			},
 			"textDocument": map[string]interface{}{
 				"publishDiagnostics": map[string]interface{}{},
 				"hover": map[string]interface{}{
@@ -335,11 +625,106 @@ func (c *LSPClient) initialize() error {
 		},
 	}
 
-	if err := c.sendRequest("initialize", params); err != nil {
+	id := s.nextID()
+	responseChan := make(chan *rpcMessage, 1)
+	s.responseMutex.Lock()
+	s.responses[id] = responseChan
+	s.responseMutex.Unlock()
+
+	request := map[string]interface{}{
+		"jsonrpc": "2.0",
+		"id":      id,
+		"method":  "initialize",
+		"params":  params,
+	}
+	if err := s.queueMessage(request, true); err != nil {
+		s.responseMutex.Lock()
+		delete(s.responses, id)
+		s.responseMutex.Unlock()
 		return err
 	}
 
-	return c.sendNotification("initialized", map[string]interface{}{})
+	// The server may not be sent anything else until it has answered, so
+	// wait for the result without holding up the editor: didOpen, changes
+	// and requests are held back until then, see sendMessage.
+	go func() {
+		select {
+		case resp := <-responseChan:
+			s.readCapabilities(resp)
+		case <-time.After(10 * time.Second):
+			s.responseMutex.Lock()
+			delete(s.responses, id)
+			s.responseMutex.Unlock()
+			if s.logCallback != nil {
+				s.logCallback("LSP", "No answer to initialize, using default capabilities")
+			}
+		}
+		s.sendInitialized()
+	}()
+	return nil
+}
+
+// sendInitialized sends the initialized notification followed by the
+// messages held back while waiting for the initialize response.
+func (s *lspServer) sendInitialized() {
+	content, _ := encodeMessage(map[string]interface{}{
+		"jsonrpc": "2.0",
+		"method":  "initialized",
+		"params":  map[string]interface{}{},
+	})
+
+	s.outboxMutex.Lock()
+	if !s.closing {
+		s.outbox = append(append(s.outbox, content), s.held...)
+	}
+	s.held = nil
+	s.initialized = true
+	s.outboxMutex.Unlock()
+	s.wakeWriter()
+}
+
+// readCapabilities stores the document sync kind and the position encoding
+// from an initialize response. The sync kind is either a number or an object
+// with a "change" field.
+func (s *lspServer) readCapabilities(resp *rpcMessage) {
+	var result struct {
+		Capabilities struct {
+			PositionEncoding string          `json:"positionEncoding"`
+			TextDocumentSync json.RawMessage `json:"textDocumentSync"`
+		} `json:"capabilities"`
+	}
+	if json.Unmarshal(resp.Result, &result) != nil {
+		return
+	}
+
+	if enc, ok := positionEncodings[result.Capabilities.PositionEncoding]; ok {
+		atomic.StoreInt32(&s.encoding, int32(enc))
+		if s.logCallback != nil {
+			s.logCallback("LSP", fmt.Sprintf("Server position encoding: %s", result.Capabilities.PositionEncoding))
+		}
+	}
+
+	raw := result.Capabilities.TextDocumentSync
+	var kind int32
+	if err := json.Unmarshal(raw, &kind); err != nil {
+		var options struct {
+			Change *int32 `json:"change"`
+		}
+		if json.Unmarshal(raw, &options) != nil || options.Change == nil {
+			return
+		}
+		kind = *options.Change
+	}
+
+	atomic.StoreInt32(&s.syncKind, kind)
+	if s.logCallback != nil {
+		s.logCallback("LSP", fmt.Sprintf("Server document sync kind: %d", kind))
+	}
+}
+
+// Encoding returns how the server counts the characters of positions.
+func (c *LSPClient) Encoding() positionEncoding {
+	return positionEncoding(atomic.LoadInt32(&c.server.encoding))
 }
 
 // sendDidOpen notifies the server that a file has been opened.
@@ -349,279 +734,438 @@ func (c *LSPClient) sendDidOpen(content string) error {
 		"textDocument": map[string]interface{}{
 			"uri":        c.uri,
 			"languageId": languageID,
-			"version":    1,
+			"version":    c.version,
 			"text":       content,
 		},
 	}
-	return c.sendNotification("textDocument/didOpen", params)
+	return c.server.sendNotification("textDocument/didOpen", params)
 }
 
-// SendDidChange notifies the server of changes to the document content.
-func (c *LSPClient) SendDidChange(content string) error {
-	params := map[string]interface{}{
-		"textDocument": map[string]interface{}{
-			"uri":     c.uri,
-			"version": c.nextID(),
-		},
-		"contentChanges": []interface{}{
-			map[string]interface{}{
-				"text": content,
-			},
-		},
+// Update records the current text of the document. The server is told about
+// it once edits have paused for Config.LSPSyncDelay, or before the next
+// request, so a burst of edits is sent as a single change. The text is a
+// persistent rope, so this is cheap enough to call on every edit.
+func (c *LSPClient) Update(text rope) {
+	c.syncMutex.Lock()
+	defer c.syncMutex.Unlock()
+
+	c.latest = text
+	c.dirty = true
+	if c.syncTimer == nil {
+		c.syncTimer = time.AfterFunc(Config.LSPSyncDelay, c.flushInBackground)
+	} else {
+		c.syncTimer.Reset(Config.LSPSyncDelay)
 	}
-	return c.sendNotification("textDocument/didChange", params)
 }
 
-// GetDiagnostics returns a copy of the current file diagnostics.
-func (c *LSPClient) GetDiagnostics() []Diagnostic {
-	c.diagMutex.RLock()
-	defer c.diagMutex.RUnlock()
+// Flush sends the changes recorded by Update that the server has not seen
+// yet. Requests call it first, so they see the current text. The change is
+// only queued for the server's writer, in order with the other messages, so
+// Flush never waits for the server to read.
+func (c *LSPClient) Flush() error {
+	c.syncMutex.Lock()
+	defer c.syncMutex.Unlock()
+
+	if !c.dirty {
+		return nil
+	}
+	c.dirty = false
+	change, ok := documentChange(c.synced, c.latest, c.Encoding())
+	if !ok {
+		return nil
+	}
+	c.synced = c.latest
+	return c.SendDidChange(change, c.latest.String)
+}
 
-	result := make([]Diagnostic, len(c.diagnostics))
-	copy(result, c.diagnostics)
-	return result
+// flushInBackground flushes when the sync timer fires, off the UI goroutine.
+func (c *LSPClient) flushInBackground() {
+	if err := c.Flush(); err != nil && c.logCallback != nil {
+		c.logCallback("LSP", fmt.Sprintf("didChange error: %v", err))
+	}
 }
 
-// Definition requests the location of the definition of the symbol at cursor.
-func (c *LSPClient) Definition(line, character int) ([]Location, error) {
-	id := c.nextID()
+// SendDidChange notifies the server of a change to the document. Servers
+// that do not accept ranged changes get the whole document from content.
+// Each change gets the next version of the document, so the caller must
+// hold syncMutex.
+func (c *LSPClient) SendDidChange(change TextChange, content func() string) error {
+	var contentChange interface{}
+	switch atomic.LoadInt32(&c.server.syncKind) {
+	case syncNone:
+		return nil
+	case syncIncremental:
+		contentChange = change
+	default:
+		contentChange = map[string]interface{}{
+			"text": content(),
+		}
+	}
+
+	c.version++
 	params := map[string]interface{}{
 		"textDocument": map[string]interface{}{
-			"uri": c.uri,
-		},
-		"position": map[string]interface{}{
-			"line":      line,
-			"character": character,
+			"uri":     c.uri,
+			"version": c.version,
 		},
+		"contentChanges": []interface{}{contentChange},
 	}
+	return c.server.sendNotification("textDocument/didChange", params)
+}
 
-	responseChan := make(chan map[string]interface{}, 1)
-	c.responseMutex.Lock()
-	c.responses[id] = responseChan
-	c.responseMutex.Unlock()
+// documentChange returns the change that turns the text old into new, or
+// false if they are equal. The changed lines are found by comparing the
+// ropes, and the range is then narrowed to the characters that differ.
+// Characters are counted in the code units of enc.
+func documentChange(old, new rope, enc positionEncoding) (TextChange, bool) {
+	start, end, newEnd := old.diff(new)
+	if start == end && start == newEnd {
+		return TextChange{}, false
+	}
 
-	if err := c.sendRequestWithID(id, "textDocument/definition", params); err != nil {
-		c.responseMutex.Lock()
-		delete(c.responses, id)
-		c.responseMutex.Unlock()
-		return nil, err
+	// Replace whole lines with their newlines. The last line has no
+	// newline, so a change that reaches it starts at the end of the line
+	// before, or covers the whole document.
+	var from Position
+	var oldText, newText string
+	switch {
+	case end < old.len():
+		from = Position{Line: start}
+		oldText = joinLines(old.slice(start, end), "", "\n")
+		newText = joinLines(new.slice(start, newEnd), "", "\n")
+	case start > 0:
+		from = enc.advance(Position{Line: start - 1}, old.line(start-1))
+		oldText = joinLines(old.slice(start, end), "\n", "")
+		newText = joinLines(new.slice(start, newEnd), "\n", "")
+	default:
+		oldText = strings.Join(old.slice(start, end), "\n")
+		newText = strings.Join(new.slice(start, newEnd), "\n")
 	}
 
-	select {
-	case resp := <-responseChan:
-		if err, ok := resp["error"]; ok {
-			return nil, fmt.Errorf("LSP error: %v", err)
-		}
+	// Trim the common prefix and suffix, keeping runes whole.
+	prefix := 0
+	for prefix < len(oldText) && prefix < len(newText) && oldText[prefix] == newText[prefix] {
+		prefix++
+	}
+	for prefix > 0 && prefix < len(oldText) && !utf8.RuneStart(oldText[prefix]) {
+		prefix--
+	}
+	suffix := 0
+	for suffix < len(oldText)-prefix && suffix < len(newText)-prefix && oldText[len(oldText)-1-suffix] == newText[len(newText)-1-suffix] {
+		suffix++
+	}
+	for suffix > 0 && !utf8.RuneStart(oldText[len(oldText)-suffix]) {
+		suffix--
+	}
 
-		result := resp["result"]
-		if result == nil {
-			return nil, nil
-		}
+	rangeStart := enc.advance(from, oldText[:prefix])
+	rangeEnd := enc.advance(rangeStart, oldText[prefix:len(oldText)-suffix])
+	return TextChange{
+		Range: Range{Start: rangeStart, End: rangeEnd},
+		Text:  newText[prefix : len(newText)-suffix],
+	}, true
+}
 
-		resJSON, _ := json.Marshal(result)
+// joinLines concatenates lines, putting before in front of and after behind
+// each of them.
+func joinLines(lines []string, before, after string) string {
+	var result strings.Builder
+	for _, line := range lines {
+		result.WriteString(before)
+		result.WriteString(line)
+		result.WriteString(after)
+	}
+	return result.String()
+}
+
+// Diagnostics returns the current file diagnostics and their version. A new
+// set replaces the slice rather than modifying it, so it may be kept but must
+// not be changed.
+func (c *LSPClient) Diagnostics() ([]Diagnostic, int64) {
+	c.diagMutex.RLock()
+	defer c.diagMutex.RUnlock()
+	return c.diagnostics, c.diagVersion
+}
+
+// Definition asks for the location of the definition of the symbol at pos.
+// done is called from another goroutine with the answer.
+func (c *LSPClient) Definition(pos Position, done func([]Location, error)) {
+	c.positionRequest("textDocument/definition", pos, 5*time.Second, func(result json.RawMessage, err error) {
+		if err != nil || isNull(result) {
+			done(nil, err)
+			return
+		}
 
 		// Definition can return a single Location or an array of them.
-		var loc Location
-		if err := json.Unmarshal(resJSON, &loc); err == nil && loc.URI != "" {
-			return []Location{loc}, nil
+		if isArray(result) {
+			var locs []Location
+			json.Unmarshal(result, &locs)
+			done(locs, nil)
+			return
 		}
 
-		var locs []Location
-		if err := json.Unmarshal(resJSON, &locs); err == nil {
-			return locs, nil
+		var loc Location
+		if err := json.Unmarshal(result, &loc); err == nil && loc.URI != "" {
+			done([]Location{loc}, nil)
+			return
 		}
+		done(nil, nil)
+	})
+}
 
-		return nil, nil
-	case <-time.After(5 * time.Second):
-		c.responseMutex.Lock()
-		delete(c.responses, id)
-		c.responseMutex.Unlock()
-		return nil, fmt.Errorf("LSP request timeout")
-	}
+// Hover asks for documentation of the symbol at pos. done is called from
+// another goroutine with the answer.
+func (c *LSPClient) Hover(pos Position, done func(string, error)) {
+	c.positionRequest("textDocument/hover", pos, 5*time.Second, func(result json.RawMessage, err error) {
+		if err != nil {
+			done("", err)
+			return
+		}
+		done(hoverText(result), nil)
+	})
 }
 
-// Hover requests documentation information for the symbol at cursor.
-func (c *LSPClient) Hover(line, character int) (string, error) {
-	id := c.nextID()
-	params := map[string]interface{}{
-		"textDocument": map[string]interface{}{
-			"uri": c.uri,
-		},
-		"position": map[string]interface{}{
-			"line":      line,
-			"character": character,
-		},
+// hoverText extracts the text of a hover result. Hover responses are complex:
+// the contents can be strings, objects, or arrays of them.
+func hoverText(result json.RawMessage) string {
+	var hover struct {
+		Contents json.RawMessage `json:"contents"`
+	}
+	if isNull(result) || json.Unmarshal(result, &hover) != nil || isNull(hover.Contents) {
+		return ""
 	}
 
-	responseChan := make(chan map[string]interface{}, 1)
-	c.responseMutex.Lock()
-	c.responses[id] = responseChan
-	c.responseMutex.Unlock()
-
-	if err := c.sendRequestWithID(id, "textDocument/hover", params); err != nil {
-		c.responseMutex.Lock()
-		delete(c.responses, id)
-		c.responseMutex.Unlock()
-		return "", err
+	if !isArray(hover.Contents) {
+		return markedString(hover.Contents)
 	}
 
-	select {
-	case resp := <-responseChan:
-		if err, ok := resp["error"]; ok {
-			return "", fmt.Errorf("LSP error: %v", err)
+	var parts []json.RawMessage
+	json.Unmarshal(hover.Contents, &parts)
+	var text strings.Builder
+	for i, part := range parts {
+		text.WriteString(markedString(part))
+		if i < len(parts)-1 {
+			text.WriteString("\n")
 		}
+	}
+	return strings.TrimSpace(text.String())
+}
 
-		result := resp["result"]
-		if result == nil {
-			return "", nil
-		}
+// markedString returns the text of a hover content, which is either a string
+// or an object with a value.
+func markedString(raw json.RawMessage) string {
+	var str string
+	if json.Unmarshal(raw, &str) == nil {
+		return stripMarkdown(str)
+	}
 
-		// Hover responses are complex: they can be strings, objects, or arrays.
-		resMap, ok := result.(map[string]interface{})
-		if !ok {
-			return "", nil
-		}
+	var content struct {
+		Value string `json:"value"`
+	}
+	json.Unmarshal(raw, &content)
+	return stripMarkdown(content.Value)
+}
 
-		contents := resMap["contents"]
-		if contents == nil {
-			return "", nil
-		}
+// Completion asks for completion items at pos. done is called from another
+// goroutine with the answer.
+func (c *LSPClient) Completion(pos Position, done func(CompletionList, error)) {
+	if c.logCallback != nil {
+		c.logCallback("LSP", fmt.Sprintf("Requesting completion at %d:%d", pos.Line, pos.Character))
+	}
 
-		if mc, ok := contents.(map[string]interface{}); ok {
-			if val, ok := mc["value"].(string); ok {
-				return stripMarkdown(val), nil
-			}
+	c.positionRequest("textDocument/completion", pos, 10*time.Second, func(result json.RawMessage, err error) {
+		if c.logCallback != nil {
+			c.logCallback("LSP", fmt.Sprintf("Received completion response (error: %v)", err))
+		}
+		if err != nil || isNull(result) {
+			done(CompletionList{}, err)
+			return
 		}
 
-		if s, ok := contents.(string); ok {
-			return stripMarkdown(s), nil
-		}
-
-		if ss, ok := contents.([]interface{}); ok {
-			var result strings.Builder
-			for i, s := range ss {
-				if str, ok := s.(string); ok {
-					result.WriteString(stripMarkdown(str))
-					if i < len(ss)-1 {
-						result.WriteString("\n")
-					}
-				} else if m, ok := s.(map[string]interface{}); ok {
-					if val, ok := m["value"].(string); ok {
-						result.WriteString(stripMarkdown(val))
-						if i < len(ss)-1 {
-							result.WriteString("\n")
-						}
-					}
-				}
-			}
-			return strings.TrimSpace(result.String()), nil
+		// Completion can return a CompletionList or an array of
+		// CompletionItems. Fields of an unexpected type are left empty
+		// instead of dropping the whole list.
+		var compList CompletionList
+		if isArray(result) {
+			json.Unmarshal(result, &compList.Items)
+		} else {
+			json.Unmarshal(result, &compList)
 		}
+		done(compList, nil)
+	})
+}
 
-		return "", nil
-	case <-time.After(5 * time.Second):
-		c.responseMutex.Lock()
-		delete(c.responses, id)
-		c.responseMutex.Unlock()
-		return "", fmt.Errorf("LSP request timeout")
+// positionRequest sends a request about a position in the document with the
+// pending changes flushed first, and passes the result to handle from another
+// goroutine. The position must be in the server's encoding, see
+// Buffer.lspPosition.
+func (c *LSPClient) positionRequest(method string, pos Position, timeout time.Duration, handle func(json.RawMessage, error)) {
+	if err := c.Flush(); err != nil {
+		go handle(nil, err)
+		return
 	}
-}
 
-// Completion requests a list of completion items for the symbol at cursor.
-func (c *LSPClient) Completion(line, character int) ([]CompletionItem, error) {
-	id := c.nextID()
 	params := map[string]interface{}{
 		"textDocument": map[string]interface{}{
 			"uri": c.uri,
 		},
-		"position": map[string]interface{}{
-			"line":      line,
-			"character": character,
-		},
+		"position": pos,
 	}
+	c.server.call(method, params, timeout, handle)
+}
 
-	if c.logCallback != nil {
-		c.logCallback("LSP", fmt.Sprintf("Requesting completion at %d:%d (ID=%d)", line, character, id))
+// call sends a request without waiting for the response and passes its
+// result to handle from another goroutine. An older request of the same
+// method that is still waiting is superseded: the server is told to cancel
+// it and its handler is never called.
+func (s *lspServer) call(method string, params interface{}, timeout time.Duration, handle func(json.RawMessage, error)) {
+	id := s.nextID()
+	responseChan := make(chan *rpcMessage, 1)
+
+	s.responseMutex.Lock()
+	old, superseded := s.pending[method]
+	if superseded {
+		// Closing the channel tells the old request's goroutine to give up.
+		// It is only closed while still registered, so the reader can no
+		// longer send to it.
+		if ch, ok := s.responses[old]; ok {
+			delete(s.responses, old)
+			close(ch)
+		} else {
+			superseded = false
+		}
 	}
+	s.responses[id] = responseChan
+	s.pending[method] = id
+	s.responseMutex.Unlock()
 
-	responseChan := make(chan map[string]interface{}, 1)
-	c.responseMutex.Lock()
-	c.responses[id] = responseChan
-	c.responseMutex.Unlock()
+	if superseded {
+		s.cancelRequest(old)
+	}
 
-	if err := c.sendRequestWithID(id, "textDocument/completion", params); err != nil {
-		c.responseMutex.Lock()
-		delete(c.responses, id)
-		c.responseMutex.Unlock()
-		return nil, err
+	if err := s.sendRequestWithID(id, method, params); err != nil {
+		s.forget(method, id)
+		go handle(nil, err)
+		return
 	}
 
-	select {
-	case resp := <-responseChan:
-		if c.logCallback != nil {
-			c.logCallback("LSP", fmt.Sprintf("Received completion response (ID=%d)", id))
+	go func() {
+		timer := time.NewTimer(timeout)
+		defer timer.Stop()
+
+		var resp *rpcMessage
+		var ok bool
+		select {
+		case resp, ok = <-responseChan:
+		case <-timer.C:
+			if s.forget(method, id) {
+				s.cancelRequest(id)
+				handle(nil, fmt.Errorf("LSP request timeout"))
+				return
+			}
+			// The response arrived or the request was superseded meanwhile.
+			resp, ok = <-responseChan
 		}
-		if err, ok := resp["error"]; ok {
-			return nil, fmt.Errorf("LSP error: %v", err)
+		if !ok {
+			return
 		}
 
-		result := resp["result"]
-		if result == nil {
-			return nil, nil
+		s.forget(method, id)
+		if resp.Error != nil {
+			handle(nil, resp.Error)
+			return
 		}
+		handle(resp.Result, nil)
+	}()
+}
 
-		resJSON, _ := json.Marshal(result)
-
-		// Completion can return a CompletionList or an array of CompletionItems.
-		var compList CompletionList
-		if err := json.Unmarshal(resJSON, &compList); err == nil {
-			return compList.Items, nil
-		}
+// forget stops waiting for the response to request id and reports whether it
+// had not arrived yet.
+func (s *lspServer) forget(method string, id int64) bool {
+	s.responseMutex.Lock()
+	defer s.responseMutex.Unlock()
 
-		var compItems []CompletionItem
-		if err := json.Unmarshal(resJSON, &compItems); err == nil {
-			return compItems, nil
-		}
+	_, waiting := s.responses[id]
+	delete(s.responses, id)
+	if s.pending[method] == id {
+		delete(s.pending, method)
+	}
+	return waiting
+}
 
-		return nil, nil
-	case <-time.After(10 * time.Second):
-		if c.logCallback != nil {
-			c.logCallback("LSP", fmt.Sprintf("Completion request timed out (ID=%d)", id))
-		}
-		c.responseMutex.Lock()
-		delete(c.responses, id)
-		c.responseMutex.Unlock()
-		return nil, fmt.Errorf("LSP request timeout")
+// cancelRequest tells the server that the answer to request id is no longer
+// needed.
+func (s *lspServer) cancelRequest(id int64) {
+	if s.logCallback != nil {
+		s.logCallback("LSP", fmt.Sprintf("Cancelling request ID=%d", id))
 	}
+	s.sendNotification("$/cancelRequest", map[string]interface{}{"id": id})
 }
 
 // sendRequestWithID helper to send a request with a pre-generated ID.
-func (c *LSPClient) sendRequestWithID(id int64, method string, params interface{}) error {
+func (s *lspServer) sendRequestWithID(id int64, method string, params interface{}) error {
 	request := map[string]interface{}{
 		"jsonrpc": "2.0",
 		"id":      id,
 		"method":  method,
 		"params":  params,
 	}
-	return c.sendMessage(request)
+	return s.sendMessage(request)
 }
 
-// Shutdown gracefully closes the LSP client and stops the server process.
-func (c *LSPClient) Shutdown() {
-	c.shutdownOnce.Do(func() {
-		c.shutdown = true
+// Close releases the document for one buffer. When no buffer uses it anymore
+// the server is sent didClose, and the server is shut down once no documents
+// are open in it.
+func (c *LSPClient) Close() {
+	lspServersMutex.Lock()
+	defer lspServersMutex.Unlock()
+
+	s := c.server
+	s.docsMutex.Lock()
+	c.refs--
+	closed := c.refs == 0
+	if closed {
+		delete(s.docs, c.uri)
+	}
+	s.docsMutex.Unlock()
+	if !closed {
+		return
+	}
 
-		c.sendRequest("shutdown", nil)
-		c.sendNotification("exit", nil)
+	c.syncMutex.Lock()
+	if c.syncTimer != nil {
+		c.syncTimer.Stop()
+	}
+	c.syncMutex.Unlock()
 
-		if c.stdin != nil {
-			c.stdin.Close()
-		}
-		if c.stdout != nil {
-			c.stdout.Close()
+	s.sendNotification("textDocument/didClose", map[string]interface{}{
+		"textDocument": map[string]interface{}{
+			"uri": c.uri,
+		},
+	})
+	s.release()
+}
+
+// Shutdown gracefully stops the server process.
+func (s *lspServer) Shutdown() {
+	s.shutdownOnce.Do(func() {
+		s.sendRequest("shutdown", nil)
+		s.sendNotification("exit", nil)
+		s.shutdown.Store(true)
+
+		// writeMessages closes stdin once the messages above are written,
+		// or drops them if the server never answered initialize.
+		s.outboxMutex.Lock()
+		s.closing = true
+		s.outboxMutex.Unlock()
+		s.wakeWriter()
+
+		if s.stdout != nil {
+			s.stdout.Close()
 		}
 
-		if c.cmd != nil && c.cmd.Process != nil {
-			c.cmd.Wait()
+		if s.cmd != nil && s.cmd.Process != nil {
+			s.cmd.Wait()
 		}
 	})
 }
@@ -0,0 +1,275 @@
+package main
+
+import (
+	"bufio"
+	"encoding/json"
+	"fmt"
+	"io"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"slices"
+	"strings"
+	"testing"
+	"time"
+	"unicode/utf16"
+	"unicode/utf8"
+)
+
+// applyChange applies a change to text the way a server counting characters
+// in enc would, and fails if a position of its range does not fall on a
+// character of text.
+func applyChange(t *testing.T, text string, change TextChange, enc positionEncoding) string {
+	t.Helper()
+
+	offset := func(p Position) int {
+		lines := strings.Split(text, "\n")
+		if p.Line >= len(lines) {
+			t.Fatalf("position %+v is past the last line of %q", p, text)
+		}
+		start := 0
+		for _, line := range lines[:p.Line] {
+			start += len(line) + 1
+		}
+		units := 0
+		for i, r := range lines[p.Line] {
+			if units == p.Character {
+				return start + i
+			}
+			switch enc {
+			case encodingUTF8:
+				units += utf8.RuneLen(r)
+			case encodingUTF16:
+				units += len(utf16.Encode([]rune{r}))
+			default:
+				units++
+			}
+			if units > p.Character {
+				t.Fatalf("position %+v splits %q in %q", p, r, lines[p.Line])
+			}
+		}
+		if units != p.Character {
+			t.Fatalf("position %+v is past the end of %q", p, lines[p.Line])
+		}
+		return start + len(lines[p.Line])
+	}
+
+	from, to := offset(change.Range.Start), offset(change.Range.End)
+	if from > to {
+		t.Fatalf("range %+v ends before it starts", change.Range)
+	}
+	return text[:from] + change.Text + text[to:]
+}
+
+var encodingNames = map[positionEncoding]string{
+	encodingUTF8:  "utf-8",
+	encodingUTF16: "utf-16",
+	encodingUTF32: "utf-32",
+}
+
+// checkDocumentChange fails unless the change documentChange returns turns
+// the text of old into that of new in every encoding.
+func checkDocumentChange(t *testing.T, old, new rope) {
+	t.Helper()
+	for enc, name := range encodingNames {
+		change, ok := documentChange(old, new, enc)
+		if !ok {
+			if old.String() != new.String() {
+				t.Fatalf("%s: no change from %q to %q", name, old.String(), new.String())
+			}
+			continue
+		}
+		if got := applyChange(t, old.String(), change, enc); got != new.String() {
+			t.Fatalf("%s: change %+v turns %q into %q, want %q", name, change, old.String(), got, new.String())
+		}
+	}
+}
+
+func TestDocumentChange(t *testing.T) {
+	base := newRope([]string{"héllo 😀 wörld", "𝄞 clef", "", "plain", "ж😀ж"})
+	tests := []struct {
+		name string
+		new  rope
+	}{
+		{"no change", base},
+		{"insert after an astral rune", base.set(0, "héllo 😀x wörld")},
+		{"replace an astral rune", base.set(1, "𝄢 clef")},
+		{"delete a multi-byte rune", base.set(4, "ж😀")},
+		{"insert a line", base.insert(2, []string{"new 😀"})},
+		{"delete the first line", base.delete(0, 1)},
+		{"delete the last line", base.delete(4, 5)},
+		{"change the last line", base.set(4, "ж😀😀ж")},
+		{"append a line", base.insert(5, []string{"𝄞"})},
+		{"join lines", base.delete(1, 2).set(0, "héllo 😀 wörld𝄞 clef")},
+		{"delete everything", newRope([]string{""})},
+		{"rewrite", newRope([]string{"完全", "に", "新しい 😀"})},
+		{"change the same rune twice", base.set(3, "plaín")},
+		// Runes that share leading or trailing bytes must not be split.
+		{"runes with a common prefix", base.set(0, "héllo 😁 wörld")},
+		{"runes with a common suffix", base.set(0, "h©llo 😀 wörld")},
+	}
+
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			checkDocumentChange(t, base, tt.new)
+		})
+	}
+}
+
+// TestDocumentChangeRandom checks documentChange on random edits of a text
+// full of multi-byte and astral runes.
+func TestDocumentChangeRandom(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	alphabet := []rune("aé©😀😁ж𝄞 ")
+	randomLine := func() string {
+		runes := make([]rune, rng.Intn(6))
+		for i := range runes {
+			runes[i] = alphabet[rng.Intn(len(alphabet))]
+		}
+		return string(runes)
+	}
+
+	lines := []string{""}
+	r := newRope(lines)
+	for step := 0; step < 3000; step++ {
+		old := r
+		y := rng.Intn(len(lines))
+		switch rng.Intn(4) {
+		case 0:
+			added := []string{randomLine(), randomLine()}[:1+rng.Intn(2)]
+			r = r.insert(y+rng.Intn(2), added)
+		case 1:
+			// A buffer always keeps a line.
+			if end := min(y+1+rng.Intn(2), len(lines)); end-y < len(lines) {
+				r = r.delete(y, end)
+			}
+		default:
+			runes := []rune(lines[y])
+			at := rng.Intn(len(runes) + 1)
+			if rng.Intn(2) == 0 && at < len(runes) {
+				runes = slices.Delete(runes, at, at+1)
+			} else {
+				runes = slices.Insert(runes, at, alphabet[rng.Intn(len(alphabet))])
+			}
+			r = r.set(y, string(runes))
+		}
+		lines = r.slice(0, r.len())
+		checkDocumentChange(t, old, r)
+	}
+}
+
+// TestLSPHelperServer is not a test: TestInitializeOrder runs the test binary
+// as a language server that answers initialize late and logs the method, and
+// the version if any, of every message it reads to $QWE_TEST_LSP_LOG.
+func TestLSPHelperServer(t *testing.T) {
+	logPath := os.Getenv("QWE_TEST_LSP_LOG")
+	if logPath == "" {
+		return
+	}
+	log, err := os.Create(logPath)
+	if err != nil {
+		os.Exit(1)
+	}
+	defer os.Exit(0)
+
+	reader := bufio.NewReader(os.Stdin)
+	for {
+		length := 0
+		for {
+			line, err := reader.ReadString('\n')
+			if err != nil {
+				return
+			}
+			if line = strings.TrimSpace(line); line == "" {
+				break
+			}
+			fmt.Sscanf(line, "Content-Length: %d", &length)
+		}
+		body := make([]byte, length)
+		if _, err := io.ReadFull(reader, body); err != nil {
+			return
+		}
+
+		var msg struct {
+			ID     json.RawMessage `json:"id"`
+			Method string          `json:"method"`
+			Params struct {
+				TextDocument struct {
+					Version int `json:"version"`
+				} `json:"textDocument"`
+			} `json:"params"`
+		}
+		json.Unmarshal(body, &msg)
+		fmt.Fprintln(log, msg.Method, msg.Params.TextDocument.Version)
+
+		if msg.Method == "initialize" {
+			// Anything the client sends meanwhile waits in the pipe.
+			time.Sleep(200 * time.Millisecond)
+			result := fmt.Sprintf(`{"jsonrpc":"2.0","id":%s,"result":{"capabilities":{"textDocumentSync":2}}}`, msg.ID)
+			fmt.Printf("Content-Length: %d\r\n\r\n%s", len(result), result)
+		}
+	}
+}
+
+// TestInitializeOrder checks that nothing is sent to a server before it has
+// answered initialize, and that the messages held back meanwhile follow the
+// initialized notification in order.
+func TestInitializeOrder(t *testing.T) {
+	logPath := filepath.Join(t.TempDir(), "lsp.log")
+	t.Setenv("QWE_TEST_LSP_LOG", logPath)
+	ft := &FileType{
+		Name:           "Go",
+		LSPCommand:     os.Args[0],
+		LSPCommandArgs: []string{"-test.run=^TestLSPHelperServer$"},
+	}
+
+	text := newRope([]string{"package main"})
+	c, err := NewLSPClient(filepath.Join(t.TempDir(), "main.go"), text, nil, ft)
+	if err != nil {
+		t.Fatal(err)
+	}
+	c.Update(text.insert(1, []string{"", "func main() {}"}))
+	if err := c.Flush(); err != nil {
+		t.Fatal(err)
+	}
+	c.Update(text)
+	if err := c.Flush(); err != nil {
+		t.Fatal(err)
+	}
+
+	// The messages are dropped if the server is shut down before it has
+	// answered.
+	server := c.server
+	for start := time.Now(); ; time.Sleep(10 * time.Millisecond) {
+		server.outboxMutex.Lock()
+		initialized := server.initialized
+		server.outboxMutex.Unlock()
+		if initialized {
+			break
+		}
+		if time.Since(start) > 5*time.Second {
+			t.Fatal("server never answered initialize")
+		}
+	}
+	c.Close()
+	server.Shutdown() // Waits for the server to exit.
+
+	got, err := os.ReadFile(logPath)
+	if err != nil {
+		t.Fatal(err)
+	}
+	want := strings.Join([]string{
+		"initialize 0",
+		"initialized 0",
+		"textDocument/didOpen 1",
+		"textDocument/didChange 2",
+		"textDocument/didChange 3",
+		"textDocument/didClose 0",
+		"shutdown 0",
+		"exit 0",
+		"",
+	}, "\n")
+	if string(got) != want {
+		t.Errorf("server read:\n%s\nwant:\n%s", got, want)
+	}
+}
@@ -52,9 +52,13 @@ func main() {
 	termbox.SetInputMode(termbox.InputEsc | termbox.InputMouse)
 	// Use 256 color mode for better aesthetics.
 	termbox.SetOutputMode(termbox.Output256)
+	// Have pastes marked, so they are inserted in one piece.
+	setBracketedPaste(true)
+	defer setBracketedPaste(false)
 
 	// Create a new editor instance.
 	editor := NewEditor(Config.DevMode)
+	defer editor.log.Close()
 	// Start background checks for Ollama AI and file changes on disk.
 	editor.ollamaClient.PeriodicStatusCheck()
 	editor.PeriodicFileChangesCheck()
@@ -63,9 +67,9 @@ func main() {
 	if flag.NArg() > 0 {
 		for _, filename := range flag.Args() {
 			if err := editor.LoadFile(filename); err != nil {
-				termbox.Close()
-				fmt.Fprintf(os.Stderr, "failed to open file %s: %v\n", filename, err)
-				os.Exit(1)
+				msg := fmt.Sprintf("failed to open file %s: %v", filename, err)
+				editor.addLog("Editor", msg)
+				editor.exit(1, msg)
 			}
 		}
 		// Start with the first file active
@@ -75,3 +79,16 @@ func main() {
 	// Enter the main event loop (keyboard and mouse input).
 	editor.HandleEvents()
 }
+
+// exit restores the terminal, writes out the log and ends the program with
+// code, printing msg to stderr unless it is empty. os.Exit skips deferred
+// calls, so every exit goes through here.
+func (e *Editor) exit(code int, msg string) {
+	e.log.Close()
+	setBracketedPaste(false)
+	termbox.Close()
+	if msg != "" {
+		fmt.Fprintln(os.Stderr, msg)
+	}
+	os.Exit(code)
+}
@@ -0,0 +1,206 @@
+package main
+
+// Bracketed paste. The terminal wraps pasted text in pasteStart and pasteEnd,
+// which termbox reports as an Esc key followed by the characters of the rest
+// of the marker. The text between them is inserted in one piece: one undo
+// entry, one syntax update, one LSP change and no auto-indent.
+
+import (
+	"os"
+	"slices"
+	"strings"
+	"time"
+	"unicode/utf8"
+
+	"github.com/nsf/termbox-go"
+)
+
+const (
+	pasteStart = "\x1b[200~"
+	pasteEnd   = "\x1b[201~"
+
+	// pasteMarkerDelay is how long to wait for the rest of a marker after an
+	// Esc. The terminal writes a marker at once, so only a lone Esc key
+	// waits this long.
+	pasteMarkerDelay = 20 * time.Millisecond
+
+	// pasteTimeout ends a paste whose end marker does not arrive.
+	pasteTimeout = 500 * time.Millisecond
+)
+
+// setBracketedPaste turns bracketed paste on or off in the terminal. It must
+// be turned off before exiting, or the shell would get the markers.
+func setBracketedPaste(on bool) {
+	tty, err := os.OpenFile("/dev/tty", os.O_WRONLY, 0)
+	if err != nil {
+		return
+	}
+	defer tty.Close()
+
+	if on {
+		tty.WriteString("\x1b[?2004h")
+	} else {
+		tty.WriteString("\x1b[?2004l")
+	}
+}
+
+// readPaste checks whether ev starts a bracketed paste and, if it does,
+// returns the key events of the pasted text. Events that are not part of the
+// paste are put back.
+func (r *eventReader) readPaste(ev termbox.Event) ([]termbox.Event, bool) {
+	if !isKey(ev, pasteStart[0]) || !r.expect(pasteStart[1:], pasteMarkerDelay) {
+		return nil, false
+	}
+
+	var keys, other []termbox.Event
+	for {
+		ev, ok := r.poll(pasteTimeout)
+		if !ok {
+			break
+		}
+		if ev.Type != termbox.EventKey {
+			other = append(other, ev)
+			continue
+		}
+		if isKey(ev, pasteEnd[0]) && r.expect(pasteEnd[1:], pasteTimeout) {
+			break
+		}
+		keys = append(keys, ev)
+	}
+	r.unread(other...)
+	return keys, true
+}
+
+// expect reads the events of the characters of s. If one of them does not
+// arrive within timeout or does not match, the events read are put back.
+func (r *eventReader) expect(s string, timeout time.Duration) bool {
+	var read []termbox.Event
+	for i := 0; i < len(s); i++ {
+		ev, ok := r.poll(timeout)
+		if !ok {
+			break
+		}
+		read = append(read, ev)
+		if !isKey(ev, s[i]) {
+			break
+		}
+		if i == len(s)-1 {
+			return true
+		}
+	}
+	r.unread(read...)
+	return false
+}
+
+// isKey reports whether ev is the key termbox reports for byte c.
+func isKey(ev termbox.Event, c byte) bool {
+	if ev.Type != termbox.EventKey || ev.Mod != 0 {
+		return false
+	}
+	if c <= ' ' || c == 0x7f {
+		return ev.Ch == 0 && ev.Key == termbox.Key(c)
+	}
+	return ev.Ch == rune(c)
+}
+
+// pastedText returns the text typed by keys. Line breaks are sent by the
+// terminal as carriage returns and become newlines.
+func pastedText(keys []termbox.Event) string {
+	var text strings.Builder
+	for _, ev := range keys {
+		switch {
+		case ev.Ch != 0:
+			text.WriteRune(ev.Ch)
+		case ev.Key <= termbox.KeySpace || ev.Key == termbox.KeyBackspace2:
+			text.WriteByte(byte(ev.Key))
+		}
+	}
+	s := strings.ReplaceAll(text.String(), "\r\n", "\n")
+	return strings.ReplaceAll(s, "\r", "\n")
+}
+
+// paste handles a bracketed paste. Normal and Insert mode insert the text
+// into the buffer; other modes get the keys as if they were typed.
+func (e *Editor) paste(keys []termbox.Event) {
+	if e.mode != ModeNormal && e.mode != ModeInsert {
+		for _, ev := range keys {
+			e.handleEvent(ev)
+		}
+		return
+	}
+
+	e.message = ""
+	e.showHover = false
+	e.showAutocomplete = false
+	e.insertText(pastedText(keys))
+}
+
+// insertText inserts text at every cursor as one undoable change and moves
+// the cursors to its end. Like insertRune it works bottom-up, so each
+// insertion only moves the cursors already done.
+func (e *Editor) insertText(text string) {
+	b := e.activeBuffer()
+	if b == nil || text == "" {
+		return
+	}
+	if b.readOnly {
+		e.message = "File is read-only"
+		return
+	}
+
+	lines := strings.Split(text, "\n")
+	last := len(lines) - 1
+	width := utf8.RuneCountInString(lines[last])
+	cursors := e.getSortedCursorsDesc()
+
+	// The paste is its own undo entry, separate from what was typed before
+	// and after it.
+	e.saveState()
+	for i, c := range cursors {
+		var line string
+		var at uint32
+		n := 0
+		if c.Y < b.lineCount() {
+			line = b.lineString(c.Y)
+			at = b.byteCol(c.Y, c.X)
+			n = 1
+		}
+
+		inserted := slices.Clone(lines)
+		inserted[0] = line[:at] + inserted[0]
+		inserted[last] += line[at:]
+		b.replaceLines(c.Y, n, inserted)
+
+		// The cursors done so far are after c and move with the text
+		// behind it.
+		for _, done := range cursors[:i] {
+			if done.Y == c.Y {
+				done.X += width
+				if last > 0 {
+					done.X -= c.X
+				}
+			}
+			if done.Y >= c.Y {
+				done.Y += last
+			}
+		}
+		if last > 0 {
+			c.X = 0
+		}
+		c.X += width
+		c.Y += last
+	}
+	e.saveState()
+
+	for _, c := range cursors {
+		if e.mode == ModeNormal && c.X > 0 {
+			c.X-- // Normal mode rests on the last inserted character.
+		}
+		c.PreferredCol = c.X
+	}
+
+	if b.syntax != nil {
+		b.syntax.Reparse(b.snapshot())
+	}
+	e.markModified()
+}
@@ -38,12 +38,12 @@ func (e *Editor) startReplaceMode() {
 	// Handle Visual Line mode by selecting entire lines.
 	if e.mode == ModeVisualLine {
 		e.replaceSelStartX = 0
-		if e.replaceSelEndY < len(b.buffer) {
-			e.replaceSelEndX = len(b.buffer[e.replaceSelEndY])
+		if e.replaceSelEndY < b.lineCount() {
+			e.replaceSelEndX = b.lineLen(e.replaceSelEndY)
 		}
 	} else {
 		// In character-wise visual mode, include the character at the end position.
-		if e.replaceSelEndY < len(b.buffer) && e.replaceSelEndX < len(b.buffer[e.replaceSelEndY]) {
+		if e.replaceSelEndY < b.lineCount() && e.replaceSelEndX < b.lineLen(e.replaceSelEndY) {
 			e.replaceSelEndX++
 		}
 	}
@@ -168,9 +168,9 @@ func (e *Editor) updateReplacePreview() {
 	}
 
 	// Scan each line within the selected range for matches.
-	for lineIdx := e.replaceSelStartY; lineIdx <= e.replaceSelEndY && lineIdx < len(b.buffer); lineIdx++ {
-		line := b.buffer[lineIdx]
-		lineStr := string(line)
+	for lineIdx := e.replaceSelStartY; lineIdx <= e.replaceSelEndY && lineIdx < b.lineCount(); lineIdx++ {
+		line := b.line(lineIdx)
+		lineStr := b.lineString(lineIdx)
 
 		startCol := 0
 		endCol := len(line)
@@ -264,9 +264,9 @@ func (e *Editor) executeReplace() {
 	// Important: Iterate backwards from top to bottom through lines,
 	// but this loop actually goes from replaceSelEndY down to replaceSelStartY.
 	// This helps maintain line index stability during multi-line operations.
-	for lineIdx := e.replaceSelEndY; lineIdx >= e.replaceSelStartY && lineIdx < len(b.buffer); lineIdx-- {
-		line := b.buffer[lineIdx]
-		lineStr := string(line)
+	for lineIdx := e.replaceSelEndY; lineIdx >= e.replaceSelStartY && lineIdx < b.lineCount(); lineIdx-- {
+		line := b.line(lineIdx)
+		lineStr := b.lineString(lineIdx)
 
 		startCol := 0
 		endCol := len(line)
@@ -318,22 +318,22 @@ func (e *Editor) executeReplace() {
 		}
 
 		// Update the line content and notify syntax highlighter of the edit.
-		oldLine := b.buffer[lineIdx]
+		oldLine := b.line(lineIdx)
 		newLineStr := prefix + newSearchPart + suffix
-		b.buffer[lineIdx] = []rune(newLineStr)
+		b.setLine(lineIdx, []rune(newLineStr))
 		e.addLog("Replace", fmt.Sprintf("Line %d: '%s' -> '%s'", lineIdx, lineStr, newLineStr))
 
-		if b.syntax != nil {
-			oldLineBytes := uint32(len(string(oldLine)))
+		if b.syntax != nil && newLineStr != lineStr {
+			// Report the whole line as replaced; the byte lengths are exact even
+			// when the regex matched multi-byte characters.
+			oldLineBytes := byteLen(oldLine)
 			newLineBytes := uint32(len(newLineStr))
-			oldEndColBytes := b.getLineByteOffset(oldLine, endCol)
-			newEndColBytes := b.getLineByteOffset(b.buffer[lineIdx], len(prefix)+len(newSearchPart))
 
 			b.handleEdit(
-				lineIdx, startCol,
+				lineIdx, 0,
 				oldLineBytes, newLineBytes,
-				lineIdx, oldEndColBytes,
-				lineIdx, newEndColBytes,
+				lineIdx, oldLineBytes,
+				lineIdx, newLineBytes,
 			)
 		}
 	}
@@ -345,9 +345,9 @@ func (e *Editor) executeReplace() {
 		e.message = "Pattern not found"
 	}
 
-	// Force a full reparse of syntax to ensure all highlights are correct after mass edits.
+	// Reparse once after all lines were edited.
 	if b.syntax != nil {
-		b.syntax.Reparse([]byte(b.toString()))
+		b.syntax.Reparse(b.snapshot())
 	}
 
 	e.mode = ModeNormal
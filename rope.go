@@ -0,0 +1,476 @@
+package main
+
+// Rope of lines backing the text of a Buffer. It is a B-tree whose leaves hold
+// runs of UTF-8 lines and whose nodes count the lines and bytes below them, so
+// line lookups, inserts, deletes and byte offset conversions are O(log n).
+// Nodes are never modified once built: edits copy the path to the changed
+// leaves, which makes a copy of the rope a cheap snapshot.
+
+import (
+	"slices"
+	"strings"
+	"unicode/utf8"
+)
+
+const (
+	ropeLeafSize = 64 // Maximum number of lines in a leaf.
+	ropeNodeSize = 16 // Maximum number of children of an inner node.
+)
+
+// rope is an immutable sequence of lines. The zero value is empty.
+type rope struct {
+	root *ropeNode
+}
+
+// ropeNode is a leaf when children is nil.
+type ropeNode struct {
+	lines    int         // Number of lines in the subtree.
+	bytes    uint32      // UTF-8 length of the subtree, counting a newline per line.
+	text     []string    // Lines of a leaf, without newlines.
+	sizes    []uint32    // Byte length of each line of a leaf, with its newline.
+	runes    []uint32    // Rune count of each line of a leaf.
+	children []*ropeNode // Children of an inner node, all of the same height.
+}
+
+// newRope builds a rope holding lines.
+func newRope(lines []string) rope {
+	sizes, runes := lineSizes(lines)
+	nodes := ropeLeaves(lines, sizes, runes)
+	for len(nodes) > 1 {
+		nodes = ropeInner(nodes)
+	}
+	if len(nodes) == 0 {
+		return rope{}
+	}
+	return rope{root: nodes[0]}
+}
+
+// len returns the number of lines.
+func (r rope) len() int {
+	if r.root == nil {
+		return 0
+	}
+	return r.root.lines
+}
+
+// line returns line y.
+func (r rope) line(y int) string {
+	n, i := r.leaf(y)
+	return n.text[i]
+}
+
+// runeCount returns the number of runes in line y.
+func (r rope) runeCount(y int) int {
+	n, i := r.leaf(y)
+	return int(n.runes[i])
+}
+
+// isASCII reports whether line y is ASCII, where rune and byte columns match.
+func (r rope) isASCII(y int) bool {
+	n, i := r.leaf(y)
+	return n.runes[i]+1 == n.sizes[i]
+}
+
+// leaf returns the leaf holding line y and the index of the line in it.
+func (r rope) leaf(y int) (*ropeNode, int) {
+	n := r.root
+	for n.children != nil {
+		for _, c := range n.children {
+			if y < c.lines {
+				n = c
+				break
+			}
+			y -= c.lines
+		}
+	}
+	return n, y
+}
+
+// forEach calls fn for every line from line start on, until fn returns false.
+func (r rope) forEach(start int, fn func(y int, line string) bool) {
+	if r.root != nil {
+		r.root.forEach(start, 0, fn)
+	}
+}
+
+func (n *ropeNode) forEach(start, base int, fn func(y int, line string) bool) bool {
+	if n.children == nil {
+		for i := max(start-base, 0); i < len(n.text); i++ {
+			if !fn(base+i, n.text[i]) {
+				return false
+			}
+		}
+		return true
+	}
+
+	for _, c := range n.children {
+		if start < base+c.lines && !c.forEach(start, base, fn) {
+			return false
+		}
+		base += c.lines
+	}
+	return true
+}
+
+// slice returns lines [start, end) in a new slice.
+func (r rope) slice(start, end int) []string {
+	lines := make([]string, 0, end-start)
+	r.forEach(start, func(y int, line string) bool {
+		if y >= end {
+			return false
+		}
+		lines = append(lines, line)
+		return true
+	})
+	return lines
+}
+
+// String returns the text of the rope, with lines separated by newlines.
+func (r rope) String() string {
+	var result strings.Builder
+	result.Grow(int(r.bytes()))
+	r.forEach(0, func(y int, line string) bool {
+		if y > 0 {
+			result.WriteString("\n")
+		}
+		result.WriteString(line)
+		return true
+	})
+	return result.String()
+}
+
+// set returns a rope with line y replaced.
+func (r rope) set(y int, line string) rope {
+	return rope{root: r.root.set(y, line)}
+}
+
+func (n *ropeNode) set(y int, line string) *ropeNode {
+	c := *n
+	if n.children == nil {
+		c.text = slices.Clone(n.text)
+		c.sizes = slices.Clone(n.sizes)
+		c.runes = slices.Clone(n.runes)
+		size := uint32(len(line)) + 1
+		c.bytes += size - c.sizes[y]
+		c.text[y] = line
+		c.sizes[y] = size
+		c.runes[y] = uint32(utf8.RuneCountInString(line))
+		return &c
+	}
+
+	c.children = slices.Clone(n.children)
+	for i, child := range c.children {
+		if y < child.lines {
+			c.children[i] = child.set(y, line)
+			c.bytes += c.children[i].bytes - child.bytes
+			break
+		}
+		y -= child.lines
+	}
+	return &c
+}
+
+// insert returns a rope with lines inserted before line y.
+func (r rope) insert(y int, lines []string) rope {
+	if len(lines) == 0 {
+		return r
+	}
+	if r.root == nil {
+		return newRope(lines)
+	}
+
+	nodes := r.root.insert(y, lines)
+	for len(nodes) > 1 {
+		nodes = ropeInner(nodes)
+	}
+	return rope{root: nodes[0]}
+}
+
+// insert returns the nodes replacing n after the insertion. There is more than
+// one when n had to be split.
+func (n *ropeNode) insert(y int, lines []string) []*ropeNode {
+	if n.children == nil {
+		newSizes, newRunes := lineSizes(lines)
+		text := slices.Insert(slices.Clone(n.text), y, lines...)
+		sizes := slices.Insert(slices.Clone(n.sizes), y, newSizes...)
+		runes := slices.Insert(slices.Clone(n.runes), y, newRunes...)
+		return ropeLeaves(text, sizes, runes)
+	}
+
+	// Insert into the first child that contains or ends at y.
+	i := 0
+	for ; i < len(n.children)-1 && y > n.children[i].lines; i++ {
+		y -= n.children[i].lines
+	}
+	children := slices.Replace(slices.Clone(n.children), i, i+1, n.children[i].insert(y, lines)...)
+	return ropeInner(children)
+}
+
+// delete returns a rope without lines [start, end).
+func (r rope) delete(start, end int) rope {
+	if start >= end {
+		return r
+	}
+
+	root := r.root.delete(start, end)
+	for root != nil && root.children != nil && len(root.children) == 1 {
+		root = root.children[0]
+	}
+	return rope{root: root}
+}
+
+// delete returns n without lines [start, end), or nil if nothing is left.
+// Children shrunk by the delete are merged with their neighbours when they
+// fit in one node, which keeps the tree from filling up with small nodes.
+func (n *ropeNode) delete(start, end int) *ropeNode {
+	if n.children == nil {
+		if start == 0 && end == len(n.text) {
+			return nil
+		}
+		text := slices.Delete(slices.Clone(n.text), start, end)
+		sizes := slices.Delete(slices.Clone(n.sizes), start, end)
+		return ropeLeaf(text, sizes, slices.Delete(slices.Clone(n.runes), start, end))
+	}
+
+	children := make([]*ropeNode, 0, len(n.children))
+	base := 0
+	shrunk := false // Whether the previous child was touched by the delete.
+	for _, c := range n.children {
+		lines := c.lines
+		touched := end > base && start < base+lines
+		if touched {
+			c = c.delete(max(start-base, 0), min(end-base, lines))
+		}
+		if c != nil && (touched || shrunk) && len(children) > 0 {
+			if m := ropeMerge(children[len(children)-1], c); m != nil {
+				children[len(children)-1] = m
+				c = nil
+			}
+		}
+		if c != nil {
+			children = append(children, c)
+		}
+		shrunk = touched
+		base += lines
+	}
+	if len(children) == 0 {
+		return nil
+	}
+	return ropeInnerNode(children)
+}
+
+// diff compares r with other, a later version of it, and returns the range
+// [start, end) of lines of r that other replaced with its lines [start,
+// otherEnd). Subtrees both ropes share are skipped without comparing their
+// lines, so finding a small change is cheap even in a large rope.
+func (r rope) diff(other rope) (start, end, otherEnd int) {
+	n, m := r.len(), other.len()
+	for start < min(n, m) {
+		if _, sharedEnd, ok := ropeShared(r, start, other, start); ok {
+			start = sharedEnd
+		} else if r.line(start) == other.line(start) {
+			start++
+		} else {
+			break
+		}
+	}
+
+	end, otherEnd = n, m
+	for end > start && otherEnd > start {
+		k := 1 // Number of equal lines ending at end.
+		if sharedStart, _, ok := ropeShared(r, end-1, other, otherEnd-1); ok {
+			k = min(end-sharedStart, end-start, otherEnd-start)
+		} else if r.line(end-1) != other.line(otherEnd-1) {
+			break
+		}
+		end -= k
+		otherEnd -= k
+	}
+	return start, end, otherEnd
+}
+
+// ropeShared returns the range of lines of a covered by the largest subtree
+// that holds line ya of a and line yb of b at the same offset in both.
+func ropeShared(a rope, ya int, b rope, yb int) (int, int, bool) {
+	type span struct {
+		node  *ropeNode
+		start int
+	}
+	var buf [16]span
+	path := buf[:0]
+	for n, start := a.root, 0; n != nil; {
+		path = append(path, span{n, start})
+		if n.children == nil {
+			break
+		}
+		for _, c := range n.children {
+			if ya < start+c.lines {
+				n = c
+				break
+			}
+			start += c.lines
+		}
+	}
+
+	for n, start := b.root, 0; n != nil; {
+		for _, s := range path {
+			if s.node == n && s.start-ya == start-yb {
+				return s.start, s.start + n.lines, true
+			}
+		}
+		if n.children == nil {
+			break
+		}
+		for _, c := range n.children {
+			if yb < start+c.lines {
+				n = c
+				break
+			}
+			start += c.lines
+		}
+	}
+	return 0, 0, false
+}
+
+// lineStart returns the byte offset at which line y starts. Line y may be one
+// past the last line, which starts at the end of the text.
+func (r rope) lineStart(y int) uint32 {
+	var offset uint32
+	n := r.root
+	if n == nil || y >= n.lines {
+		return r.bytes()
+	}
+	for n.children != nil {
+		for _, c := range n.children {
+			if y < c.lines {
+				n = c
+				break
+			}
+			y -= c.lines
+			offset += c.bytes
+		}
+	}
+	for _, size := range n.sizes[:y] {
+		offset += size
+	}
+	return offset
+}
+
+// lineAt returns the line holding the byte at offset and the byte column of
+// the offset in that line. Offsets past the end map to the end of the last
+// line.
+func (r rope) lineAt(offset uint32) (int, uint32) {
+	n := r.root
+	if n == nil {
+		return 0, 0
+	}
+	if offset >= n.bytes {
+		return n.lines - 1, n.bytes - r.lineStart(n.lines-1) - 1
+	}
+
+	y := 0
+	for n.children != nil {
+		for _, c := range n.children {
+			if offset < c.bytes {
+				n = c
+				break
+			}
+			y += c.lines
+			offset -= c.bytes
+		}
+	}
+	for i, size := range n.sizes {
+		if offset < size {
+			return y + i, offset
+		}
+		offset -= size
+	}
+	return y + len(n.sizes) - 1, n.sizes[len(n.sizes)-1] - 1
+}
+
+// bytes returns the UTF-8 length of the text, counting a newline per line.
+func (r rope) bytes() uint32 {
+	if r.root == nil {
+		return 0
+	}
+	return r.root.bytes
+}
+
+// ropeLeaf returns a leaf holding text, where sizes are the byte lengths of
+// the lines with their newlines and runes their rune counts.
+func ropeLeaf(text []string, sizes, runes []uint32) *ropeNode {
+	n := &ropeNode{lines: len(text), text: text, sizes: sizes, runes: runes}
+	for _, size := range sizes {
+		n.bytes += size
+	}
+	return n
+}
+
+// ropeInnerNode returns an inner node over children.
+func ropeInnerNode(children []*ropeNode) *ropeNode {
+	n := &ropeNode{children: children}
+	for _, c := range children {
+		n.lines += c.lines
+		n.bytes += c.bytes
+	}
+	return n
+}
+
+// ropeLeaves splits lines evenly into as few leaves as will hold them.
+func ropeLeaves(lines []string, sizes, runes []uint32) []*ropeNode {
+	leaves := make([]*ropeNode, 0, (len(lines)+ropeLeafSize-1)/ropeLeafSize)
+	for _, chunk := range ropeChunks(len(lines), ropeLeafSize) {
+		start, end := chunk[0], chunk[1]
+		leaves = append(leaves, ropeLeaf(lines[start:end:end], sizes[start:end:end], runes[start:end:end]))
+	}
+	return leaves
+}
+
+// ropeInner groups nodes evenly under as few inner nodes as will hold them.
+func ropeInner(nodes []*ropeNode) []*ropeNode {
+	parents := make([]*ropeNode, 0, (len(nodes)+ropeNodeSize-1)/ropeNodeSize)
+	for _, chunk := range ropeChunks(len(nodes), ropeNodeSize) {
+		parents = append(parents, ropeInnerNode(nodes[chunk[0]:chunk[1]:chunk[1]]))
+	}
+	return parents
+}
+
+// ropeChunks splits [0, n) into the fewest ranges of at most size elements,
+// with lengths differing by at most one.
+func ropeChunks(n, size int) [][2]int {
+	k := (n + size - 1) / size
+	chunks := make([][2]int, k)
+	start := 0
+	for i := range chunks {
+		end := start + (n-start)/(k-i)
+		chunks[i] = [2]int{start, end}
+		start = end
+	}
+	return chunks
+}
+
+// ropeMerge returns a single node holding a followed by b, or nil if they do
+// not fit in one.
+func ropeMerge(a, b *ropeNode) *ropeNode {
+	if a.children == nil && len(a.text)+len(b.text) <= ropeLeafSize {
+		text := append(slices.Clip(a.text), b.text...)
+		sizes := append(slices.Clip(a.sizes), b.sizes...)
+		return ropeLeaf(text, sizes, append(slices.Clip(a.runes), b.runes...))
+	}
+	if a.children != nil && len(a.children)+len(b.children) <= ropeNodeSize {
+		return ropeInnerNode(append(slices.Clip(a.children), b.children...))
+	}
+	return nil
+}
+
+// lineSizes returns the byte lengths of lines with their newlines and their
+// rune counts.
+func lineSizes(lines []string) ([]uint32, []uint32) {
+	sizes := make([]uint32, len(lines))
+	runes := make([]uint32, len(lines))
+	for i, line := range lines {
+		sizes[i] = uint32(len(line)) + 1
+		runes[i] = uint32(utf8.RuneCountInString(line))
+	}
+	return sizes, runes
+}
@@ -0,0 +1,226 @@
+package main
+
+import (
+	"fmt"
+	"math/rand"
+	"slices"
+	"strings"
+	"testing"
+	"unicode/utf8"
+)
+
+// numberedLines returns n lines, numbered from first, some of them not ASCII.
+func numberedLines(first, n int) []string {
+	lines := make([]string, n)
+	for i := range lines {
+		if (first+i)%3 == 0 {
+			lines[i] = fmt.Sprintf("línea %d 😀", first+i)
+		} else {
+			lines[i] = fmt.Sprintf("line %d", first+i)
+		}
+	}
+	return lines
+}
+
+// checkRope fails unless r holds want and its nodes are consistent: the
+// counts of every node match what is below it, nodes are neither empty nor
+// over full, and all leaves are at the same depth.
+func checkRope(t *testing.T, r rope, want []string) {
+	t.Helper()
+
+	if r.len() != len(want) {
+		t.Fatalf("len() = %d, want %d", r.len(), len(want))
+	}
+	if got := r.String(); got != strings.Join(want, "\n") {
+		t.Fatalf("String() = %q, want %q", got, strings.Join(want, "\n"))
+	}
+
+	var offset uint32
+	for y, line := range want {
+		if got := r.line(y); got != line {
+			t.Fatalf("line(%d) = %q, want %q", y, got, line)
+		}
+		if got := r.runeCount(y); got != utf8.RuneCountInString(line) {
+			t.Fatalf("runeCount(%d) = %d, want %d", y, got, utf8.RuneCountInString(line))
+		}
+		if got := r.isASCII(y); got != (len(line) == utf8.RuneCountInString(line)) {
+			t.Fatalf("isASCII(%d) = %v for %q", y, got, line)
+		}
+		if got := r.lineStart(y); got != offset {
+			t.Fatalf("lineStart(%d) = %d, want %d", y, got, offset)
+		}
+		if gotY, gotCol := r.lineAt(offset + uint32(len(line))); gotY != y || gotCol != uint32(len(line)) {
+			t.Fatalf("lineAt(%d) = %d, %d, want %d, %d", offset+uint32(len(line)), gotY, gotCol, y, len(line))
+		}
+		offset += uint32(len(line)) + 1
+	}
+	if r.bytes() != offset || r.lineStart(len(want)) != offset {
+		t.Fatalf("bytes() = %d, lineStart(end) = %d, want %d", r.bytes(), r.lineStart(len(want)), offset)
+	}
+
+	if r.root == nil {
+		return
+	}
+	depth := -1
+	var check func(n *ropeNode, level int)
+	check = func(n *ropeNode, level int) {
+		lines, bytes := 0, uint32(0)
+		if n.children == nil {
+			if depth >= 0 && depth != level {
+				t.Fatalf("leaf at depth %d, want %d", level, depth)
+			}
+			depth = level
+			if len(n.text) == 0 || len(n.text) > ropeLeafSize {
+				t.Fatalf("leaf holds %d lines", len(n.text))
+			}
+			if len(n.sizes) != len(n.text) || len(n.runes) != len(n.text) {
+				t.Fatalf("leaf has %d lines, %d sizes and %d rune counts", len(n.text), len(n.sizes), len(n.runes))
+			}
+			lines = len(n.text)
+			for _, size := range n.sizes {
+				bytes += size
+			}
+		} else {
+			if len(n.children) == 0 || len(n.children) > ropeNodeSize {
+				t.Fatalf("inner node has %d children", len(n.children))
+			}
+			for _, c := range n.children {
+				check(c, level+1)
+				lines += c.lines
+				bytes += c.bytes
+			}
+		}
+		if n.lines != lines || n.bytes != bytes {
+			t.Fatalf("node counts %d lines and %d bytes, holds %d and %d", n.lines, n.bytes, lines, bytes)
+		}
+	}
+	check(r.root, 0)
+}
+
+func TestRopeInsertDelete(t *testing.T) {
+	big := numberedLines(0, 3000) // Three levels deep.
+	tests := []struct {
+		name string
+		edit func(r rope) rope
+		want func(lines []string) []string
+	}{
+		{"insert into empty", func(r rope) rope { return rope{}.insert(0, []string{"a", "b"}) },
+			func([]string) []string { return []string{"a", "b"} }},
+		{"insert at start", func(r rope) rope { return r.insert(0, []string{"x"}) },
+			func(l []string) []string { return slices.Insert(l, 0, "x") }},
+		{"insert at end", func(r rope) rope { return r.insert(r.len(), []string{"x", "y"}) },
+			func(l []string) []string { return append(l, "x", "y") }},
+		{"insert splitting a leaf", func(r rope) rope { return r.insert(100, []string{"x"}) },
+			func(l []string) []string { return slices.Insert(l, 100, "x") }},
+		{"insert splitting the root", func(r rope) rope { return r.insert(1500, numberedLines(-70000, 70000)) },
+			func(l []string) []string { return slices.Insert(l, 1500, numberedLines(-70000, 70000)...) }},
+		{"insert nothing", func(r rope) rope { return r.insert(5, nil) },
+			func(l []string) []string { return l }},
+		{"delete at start", func(r rope) rope { return r.delete(0, 1) },
+			func(l []string) []string { return l[1:] }},
+		{"delete at end", func(r rope) rope { return r.delete(r.len()-2, r.len()) },
+			func(l []string) []string { return l[:len(l)-2] }},
+		{"delete a whole leaf", func(r rope) rope { return r.delete(64, 128) },
+			func(l []string) []string { return slices.Delete(l, 64, 128) }},
+		{"delete across leaves", func(r rope) rope { return r.delete(30, 200) },
+			func(l []string) []string { return slices.Delete(l, 30, 200) }},
+		{"delete merging subtrees", func(r rope) rope { return r.delete(10, 2990) },
+			func(l []string) []string { return slices.Delete(l, 10, 2990) }},
+		{"delete everything", func(r rope) rope { return r.delete(0, r.len()) },
+			func([]string) []string { return nil }},
+		{"delete nothing", func(r rope) rope { return r.delete(7, 7) },
+			func(l []string) []string { return l }},
+		{"set", func(r rope) rope { return r.set(2999, "é") },
+			func(l []string) []string { l[2999] = "é"; return l }},
+	}
+
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			r := newRope(big)
+			got := tt.edit(r)
+			checkRope(t, got, tt.want(slices.Clone(big)))
+			checkRope(t, r, big) // The old version is unchanged.
+		})
+	}
+}
+
+func TestRopeDiff(t *testing.T) {
+	lines := numberedLines(0, 2000)
+	base := newRope(lines)
+	tests := []struct {
+		name             string
+		old, new         rope
+		start, end, nEnd int
+	}{
+		{"same rope", base, base, 2000, 2000, 2000},
+		{"rebuilt, equal", base, newRope(lines), 2000, 2000, 2000},
+		{"set", base, base.set(1000, "x"), 1000, 1001, 1001},
+		{"set to the same line", base, base.set(1000, lines[1000]), 2000, 2000, 2000},
+		{"insert", base, base.insert(700, []string{"x", "y"}), 700, 700, 702},
+		{"delete", base, base.delete(5, 1500), 5, 1500, 5},
+		{"edit at start", base, base.set(0, "x"), 0, 1, 1},
+		{"edit at end", base, base.set(1999, "x"), 1999, 2000, 2000},
+		{"append", base, base.insert(2000, []string{"x"}), 2000, 2000, 2001},
+		{"rebuilt, one line differs", base, newRope(slices.Replace(slices.Clone(lines), 1234, 1235, "x")), 1234, 1235, 1235},
+		{"rewritten", base, newRope(numberedLines(5000, 2000)), 0, 2000, 2000},
+		{"from empty", rope{}, base, 0, 0, 2000},
+		{"to empty", base, base.delete(0, 2000), 0, 2000, 0},
+		// A repeated line must not be matched against itself at the other
+		// end of the change.
+		{"repeated lines", newRope([]string{"a", "a"}), newRope([]string{"a"}), 1, 2, 1},
+	}
+
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			start, end, nEnd := tt.old.diff(tt.new)
+			if start != tt.start || end != tt.end || nEnd != tt.nEnd {
+				t.Errorf("diff = %d, %d, %d, want %d, %d, %d", start, end, nEnd, tt.start, tt.end, tt.nEnd)
+			}
+		})
+	}
+}
+
+// TestRopeRandomEdits applies random edits to a rope and to a slice of lines
+// and checks that they agree, that the counts stay consistent, and that diff
+// finds the lines between the common prefix and suffix of each pair of
+// versions.
+func TestRopeRandomEdits(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	var lines []string
+	var r rope
+	next := 0
+	for step := 0; step < 2000; step++ {
+		old, oldLines := r, slices.Clone(lines)
+
+		switch y := rng.Intn(len(lines) + 1); {
+		case rng.Intn(3) == 0 && len(lines) > 0:
+			end := min(y+1+rng.Intn(200), len(lines))
+			y = min(y, end-1)
+			r = r.delete(y, end)
+			lines = slices.Delete(lines, y, end)
+		case rng.Intn(2) == 0 && y < len(lines):
+			line := fmt.Sprintf("set ü %d", step)
+			r = r.set(y, line)
+			lines[y] = line
+		default:
+			added := numberedLines(next, 1+rng.Intn(150))
+			next += len(added)
+			r = r.insert(y, added)
+			lines = slices.Insert(lines, y, added...)
+		}
+		checkRope(t, r, lines)
+
+		wantStart := 0
+		for wantStart < min(len(oldLines), len(lines)) && oldLines[wantStart] == lines[wantStart] {
+			wantStart++
+		}
+		wantEnd, wantNewEnd := len(oldLines), len(lines)
+		for wantEnd > wantStart && wantNewEnd > wantStart && oldLines[wantEnd-1] == lines[wantNewEnd-1] {
+			wantEnd--
+			wantNewEnd--
+		}
+		if start, end, newEnd := old.diff(r); start != wantStart || end != wantEnd || newEnd != wantNewEnd {
+			t.Fatalf("step %d: diff = %d, %d, %d, want %d, %d, %d", step, start, end, newEnd, wantStart, wantEnd, wantNewEnd)
+		}
+	}
+}
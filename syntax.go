@@ -6,6 +6,10 @@ package main
 import (
 	"context"
 	"fmt"
+	"math"
+	"slices"
+	"sort"
+	"sync"
 
 	sitter "github.com/mitjafelicijan/go-tree-sitter"
 	"github.com/mitjafelicijan/go-tree-sitter/bash"
@@ -26,15 +30,64 @@ import (
 	"github.com/nsf/termbox-go"
 )
 
+// spanToLineEnd is used as the end column of a span that covers the rest of
+// the line, e.g. the middle lines of a multi-line comment.
+const spanToLineEnd = math.MaxUint32
+
+// highlightMargin is the number of lines above and below the requested range
+// that are highlighted along with it, so short scrolls hit the cache.
+const highlightMargin = 64
+
+// HighlightSpan colors the byte columns [Start, End) of a line.
+type HighlightSpan struct {
+	Start uint32
+	End   uint32
+	Color ColorName // Looked up in the current theme when drawn.
+}
+
 // SyntaxHighlighter manages the tree-sitter parser, tree, and calculated highlights for a buffer.
+//
+// Parsing and highlight queries run on a worker goroutine that owns the parser
+// and the tree. The UI goroutine reports edits, requests parses and reads the
+// highlight cache; the state they share is guarded by mu.
 type SyntaxHighlighter struct {
-	Parser     *sitter.Parser
-	Tree       *sitter.Tree
-	Lang       *sitter.Language
-	Query      *sitter.Query
-	Language   string
-	Highlights map[int]map[int]termbox.Attribute // Cached colors: Line -> Col -> termbox.Attribute
-	Log        func(string, string)              // Debug logging function.
+	Parser   *sitter.Parser // Owned by the worker.
+	Tree     *sitter.Tree   // Owned by the worker.
+	Lang     *sitter.Language
+	Query    *sitter.Query
+	Language string
+	Log      func(string, string)
+	notify   func() // Called by the worker after it published new highlights.
+
+	captureColors []ColorName // Color of each capture of Query, by capture id.
+
+	mu         sync.Mutex
+	Highlights [][]HighlightSpan  // Cached colors per line, sorted and non-overlapping.
+	version    int                // Incremented by every edit and parse request.
+	edits      []sitter.EditInput // Edits not sent to the worker yet.
+	job        *parseJob          // Parse request not picked up by the worker yet.
+	cancel     context.CancelFunc // Cancels the most recent parse request.
+	viewStart  int                // First line the UI wants highlighted.
+	viewEnd    int                // Line after the last one the UI wants highlighted.
+	wake       chan struct{}
+	running    bool
+	closed     bool
+	held       bool // Parse requests wait for Release.
+
+	treeVersion int // Version the tree was parsed at.
+
+	// Worker state.
+	fresh []bool    // Lines whose Highlights were computed from the tree.
+	input lineInput // Feeds the lines of the job being parsed to the parser.
+}
+
+// parseJob is a parse request handed to the worker.
+type parseJob struct {
+	ctx     context.Context
+	version int
+	lines   rope               // Snapshot of the buffer, see Buffer.snapshot.
+	edits   []sitter.EditInput // Edits to apply to the tree before parsing.
+	full    bool               // Parse from scratch instead of reusing the tree.
 }
 
 // NewSyntaxHighlighter initializes a parser for the given file type.
@@ -96,11 +149,12 @@ func NewSyntaxHighlighter(fileType string, log func(string, string)) *SyntaxHigh
 
 	parser.SetLanguage(lang)
 	s := &SyntaxHighlighter{
-		Parser:     parser,
-		Lang:       lang,
-		Language:   langName,
-		Highlights: make(map[int]map[int]termbox.Attribute),
-		Log:        log,
+		Parser:   parser,
+		Lang:     lang,
+		Language: langName,
+		Log:      log,
+		notify:   termbox.Interrupt,
+		wake:     make(chan struct{}, 1),
 	}
 
 	// Load the tree-sitter query file (.scm) for this language.
@@ -127,41 +181,251 @@ func (s *SyntaxHighlighter) LoadQuery(path string) {
 	q, err := sitter.NewQuery(content, s.Lang)
 	if err == nil {
 		s.Query = q
+		s.captureColors = make([]ColorName, q.CaptureCount())
+		for id := range s.captureColors {
+			s.captureColors[id] = captureColor(q.CaptureNameForId(uint32(id)))
+		}
 	} else if s.Log != nil {
 		s.Log("TS", fmt.Sprintf("LoadQuery failed to compile query for %s: %v", path, err))
 	}
 }
 
-// Parse runs a full parse of the content and updates the highlight cache.
-func (s *SyntaxHighlighter) Parse(content []byte) {
-	if s.Parser == nil {
+// Parse requests a full parse of the lines.
+func (s *SyntaxHighlighter) Parse(lines rope) {
+	s.request(lines, true)
+}
+
+// Reparse requests a parse of the lines that reuses the old tree when all
+// changes since the last parse were reported through Edit, and marks only the
+// lines whose syntax changed as stale. Otherwise it falls back to a full parse.
+func (s *SyntaxHighlighter) Reparse(lines rope) {
+	s.request(lines, false)
+}
+
+// request queues a parse for the worker. A parse that is still running is
+// canceled, and a request the worker has not picked up yet is merged with
+// this one.
+func (s *SyntaxHighlighter) request(lines rope, full bool) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if s.closed || s.Parser == nil {
 		return
 	}
-	tree, _ := s.Parser.ParseCtx(context.Background(), nil, content)
-	s.Tree = tree
-	s.updateHighlights(content)
+
+	s.version++
+	if s.cancel != nil {
+		s.cancel()
+	}
+	ctx, cancel := context.WithCancel(context.Background())
+	s.cancel = cancel
+
+	job := s.job
+	if job == nil {
+		job = &parseJob{}
+	}
+	job.ctx = ctx
+	job.version = s.version
+	job.lines = lines
+	job.edits = append(job.edits, s.edits...)
+	job.full = job.full || full || len(s.edits) == 0
+	s.job = job
+	s.edits = nil
+
+	if !s.held {
+		s.wakeWorker()
+	}
+}
+
+// Hold makes parse requests wait until Release, so a burst of edits is
+// parsed once. Parses already running are still canceled by new requests.
+func (s *SyntaxHighlighter) Hold() {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	s.held = true
+}
+
+// Release hands the parse requested since Hold, if any, to the worker.
+func (s *SyntaxHighlighter) Release() {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	s.held = false
+	if s.job != nil {
+		s.wakeWorker()
+	}
+}
+
+// Edit reports an edit to the buffer so the next Reparse only has to re-scan
+// the modified region. The cached highlights move with the edit, so they can
+// be shown until the worker has highlighted the lines again.
+func (s *SyntaxHighlighter) Edit(edit sitter.EditInput) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	s.version++
+	s.edits = append(s.edits, edit)
+	s.Highlights = spliceEdit(s.Highlights, edit, true)
 }
 
-// Reparse is a wrapper around Parse (used for batch updates).
-func (s *SyntaxHighlighter) Reparse(content []byte) {
-	s.Parse(content)
+// EnsureHighlighted asks the worker to bring the highlights of lines
+// [startRow, endRow) plus a margin around them up to date. The worker calls
+// notify once they are available.
+func (s *SyntaxHighlighter) EnsureHighlighted(startRow, endRow int) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	s.viewStart = max(startRow-highlightMargin, 0)
+	s.viewEnd = endRow + highlightMargin
+	s.wakeWorker()
 }
 
-// Edit is a placeholder for incremental parsing (currently does a full reparse).
-func (s *SyntaxHighlighter) Edit(edit sitter.EditInput, newContent []byte) {
-	s.Reparse(newContent)
+// Close stops the worker and cancels a running parse.
+func (s *SyntaxHighlighter) Close() {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if s.closed {
+		return
+	}
+
+	s.closed = true
+	if s.cancel != nil {
+		s.cancel()
+	}
+	close(s.wake)
 }
 
-// updateHighlights executes the tree-sitter query on the syntax tree and populates the highlight cache.
-func (s *SyntaxHighlighter) updateHighlights(source []byte) {
-	// Always clear previous highlights to prevent ghosting.
-	s.Highlights = make(map[int]map[int]termbox.Attribute)
+// wakeWorker starts the worker if needed and signals it that there is work.
+// Must be called with mu held.
+func (s *SyntaxHighlighter) wakeWorker() {
+	if s.closed {
+		return
+	}
+	if !s.running {
+		s.running = true
+		go s.run()
+	}
+
+	select {
+	case s.wake <- struct{}{}:
+	default:
+	}
+}
+
+// run is the worker loop. Each wake-up runs the pending parse, if any, and
+// highlights the stale lines of the requested view.
+func (s *SyntaxHighlighter) run() {
+	for range s.wake {
+		s.mu.Lock()
+		job := s.job
+		s.job = nil
+		start, end := s.viewStart, s.viewEnd
+		s.mu.Unlock()
+
+		if job != nil && !s.parse(job) {
+			continue
+		}
+		s.highlightView(start, end)
+	}
+}
+
+// parse applies the edits of a job to the tree and parses its lines. It
+// returns false if the parse failed, usually because a newer request canceled
+// it; the tree keeps the edits, so the next request can still reuse it.
+func (s *SyntaxHighlighter) parse(job *parseJob) bool {
+	if job.full {
+		s.Tree = nil
+	}
+	if s.Tree != nil {
+		for _, edit := range job.edits {
+			s.Tree.Edit(edit)
+			s.fresh = spliceEdit(s.fresh, edit, false)
+		}
+	}
+
+	s.input.lines = job.lines
+	tree, err := s.Parser.ParseInputCtx(job.ctx, s.Tree, sitter.Input{
+		Read:     s.input.read,
+		Encoding: sitter.InputEncodingUTF8,
+	})
+	s.input.lines = rope{}
+	if err != nil {
+		// Do not resume the aborted parse with the next request's content.
+		s.Parser.Reset()
+		if job.ctx.Err() == nil && s.Log != nil {
+			s.Log("TS", fmt.Sprintf("Parse failed: %v", err))
+		}
+		return false
+	}
+
+	// Edits already moved the flags, so the line count only differs from the
+	// tree after a full parse or when an edit was reported wrong.
+	lines := int(tree.RootNode().EndPoint().Row) + 1
+	if s.Tree == nil || len(s.fresh) != lines {
+		s.fresh = make([]bool, lines)
+	} else {
+		for _, r := range s.Tree.ChangedRanges(tree) {
+			for row := int(r.StartPoint.Row); row <= int(r.EndPoint.Row) && row < lines; row++ {
+				s.fresh[row] = false
+			}
+		}
+	}
+
+	s.Tree = tree
+	s.mu.Lock()
+	s.treeVersion = job.version
+	s.mu.Unlock()
+	return true
+}
 
+// highlightView highlights the stale lines in [startRow, endRow) and publishes
+// them, unless the buffer was edited since the tree was parsed.
+func (s *SyntaxHighlighter) highlightView(startRow, endRow int) {
 	if s.Tree == nil || s.Query == nil {
 		return
 	}
 
+	// Narrow the range to the first and last stale line.
+	endRow = min(endRow, len(s.fresh))
+	for startRow < endRow && s.fresh[startRow] {
+		startRow++
+	}
+	for endRow > startRow && s.fresh[endRow-1] {
+		endRow--
+	}
+	if startRow >= endRow {
+		return
+	}
+
+	rows := s.queryRows(startRow, endRow)
+
+	s.mu.Lock()
+	if s.version != s.treeVersion {
+		// The result would not line up with the buffer anymore. The lines
+		// stay stale and are highlighted after the next parse.
+		s.mu.Unlock()
+		return
+	}
+	if len(s.Highlights) != len(s.fresh) {
+		s.Highlights = slices.Grow(s.Highlights[:min(len(s.Highlights), len(s.fresh))], len(s.fresh))[:len(s.fresh)]
+	}
+	for i, spans := range rows {
+		s.Highlights[startRow+i] = spans
+		s.fresh[startRow+i] = true
+	}
+	s.mu.Unlock()
+
+	if s.notify != nil {
+		s.notify()
+	}
+}
+
+// queryRows executes the tree-sitter query on lines [startRow, endRow) of the
+// syntax tree and returns their highlight spans.
+func (s *SyntaxHighlighter) queryRows(startRow, endRow int) [][]HighlightSpan {
+	rows := make([][]HighlightSpan, endRow-startRow)
+
 	qc := sitter.NewQueryCursor()
+	defer qc.Close()
+	qc.SetPointRange(sitter.Point{Row: uint32(startRow)}, sitter.Point{Row: uint32(endRow)})
 	qc.Exec(s.Query, s.Tree.RootNode())
 
 	for {
@@ -171,46 +435,122 @@ func (s *SyntaxHighlighter) updateHighlights(source []byte) {
 		}
 
 		for _, c := range m.Captures {
-			// Find the theme attribute for the capture name (e.g., "function", "keyword").
-			captureName := s.Query.CaptureNameForId(c.Index)
-			attr := getTermboxAttr(captureName)
-
-			startRow := int(c.Node.StartPoint().Row)
-			startCol := int(c.Node.StartPoint().Column)
-			endRow := int(c.Node.EndPoint().Row)
-			endCol := int(c.Node.EndPoint().Column)
-
-			// Map the capture span to line/column color attributes.
-			for r := startRow; r <= endRow; r++ {
-				if _, ok := s.Highlights[r]; !ok {
-					s.Highlights[r] = make(map[int]termbox.Attribute)
-				}
-
-				cStart := 0
-				if r == startRow {
-					cStart = startCol
-				}
+			color := s.captureColors[c.Index]
 
-				cEnd := -1
-				if r == endRow {
-					cEnd = endCol
-				}
+			start := c.Node.StartPoint()
+			end := c.Node.EndPoint()
 
-				limit := cEnd
-				if limit == -1 {
-					limit = 1000 // A reasonable overflow limit for whole lines.
+			// Map the capture to one span per covered line inside the range.
+			for r := max(int(start.Row), startRow); r <= int(end.Row) && r < endRow; r++ {
+				span := HighlightSpan{Start: 0, End: spanToLineEnd, Color: color}
+				if r == int(start.Row) {
+					span.Start = start.Column
 				}
-
-				for col := cStart; col < limit; col++ {
-					s.Highlights[r][col] = attr
+				if r == int(end.Row) {
+					span.End = end.Column
 				}
+				rows[r-startRow] = insertSpan(rows[r-startRow], span)
 			}
 		}
 	}
+	return rows
+}
+
+// inputChunkSize is the number of bytes lineInput tries to hand to the
+// parser per read.
+const inputChunkSize = 4096
+
+// lineInput serves a snapshot of the buffer lines to the parser as UTF-8
+// text, so the buffer never has to be joined into a single string.
+type lineInput struct {
+	lines rope
+	chunk []byte // Reused for every read; the binding copies it.
+}
+
+// read returns the text starting at pos. The parser passes the position along
+// with the byte offset, so the line is found without an offset index.
+func (in *lineInput) read(offset uint32, pos sitter.Point) []byte {
+	row := int(pos.Row)
+	last := in.lines.len() - 1
+	if row > last {
+		return nil
+	}
+
+	col := min(int(pos.Column), len(in.lines.line(row)))
+	in.chunk = in.chunk[:0]
+	in.lines.forEach(row, func(y int, line string) bool {
+		in.chunk = append(in.chunk, line[col:]...)
+		if y < last {
+			in.chunk = append(in.chunk, '\n')
+		}
+		col = 0
+		return len(in.chunk) < inputChunkSize
+	})
+	return in.chunk
+}
+
+// spliceEdit adjusts a slice with one entry per line to an edit: the entries
+// of the lines the edit replaced make way for one entry per line it inserted.
+// With keep set, those start out with the values of the replaced lines,
+// otherwise with zero values.
+func spliceEdit[T any](lines []T, edit sitter.EditInput, keep bool) []T {
+	start := int(edit.StartPoint.Row)
+	if start >= len(lines) {
+		return lines
+	}
+
+	oldEnd := min(int(edit.OldEndPoint.Row), len(lines)-1)
+	added := make([]T, int(edit.NewEndPoint.Row)-start+1)
+	if keep {
+		copy(added, lines[start:oldEnd+1])
+	}
+	return slices.Replace(lines, start, oldEnd+1, added...)
 }
 
-// getTermboxAttr maps a tree-sitter capture name to a color name from our theme.
-func getTermboxAttr(captureName string) termbox.Attribute {
+// insertSpan adds span to a sorted list of non-overlapping spans. Parts of
+// existing spans covered by the new one are overwritten, so later captures
+// take precedence like they did when colors were assigned per column.
+func insertSpan(spans []HighlightSpan, span HighlightSpan) []HighlightSpan {
+	if span.Start >= span.End {
+		return spans
+	}
+
+	// Captures arrive ordered by start position, so most spans are appended.
+	n := len(spans)
+	if n == 0 || spans[n-1].End <= span.Start {
+		return append(spans, span)
+	}
+
+	// spans[i:j] are the spans overlapping the new one.
+	i := sort.Search(n, func(k int) bool { return spans[k].End > span.Start })
+	j := sort.Search(n, func(k int) bool { return spans[k].Start >= span.End })
+
+	var repl [3]HighlightSpan
+	cnt := 0
+	if i < j && spans[i].Start < span.Start {
+		repl[cnt] = HighlightSpan{Start: spans[i].Start, End: span.Start, Color: spans[i].Color}
+		cnt++
+	}
+	repl[cnt] = span
+	cnt++
+	if i < j && spans[j-1].End > span.End {
+		repl[cnt] = HighlightSpan{Start: span.End, End: spans[j-1].End, Color: spans[j-1].Color}
+		cnt++
+	}
+
+	// Splice repl into spans[i:j] in place.
+	tail := n - j
+	newLen := i + cnt + tail
+	if newLen > n {
+		spans = append(spans, repl[:newLen-n]...)
+	}
+	copy(spans[i+cnt:newLen], spans[j:n])
+	copy(spans[i:], repl[:cnt])
+	return spans[:newLen]
+}
+
+// captureColor maps a tree-sitter capture name to a color name from our theme.
+func captureColor(captureName string) ColorName {
 	var cn ColorName
 	switch captureName {
 	case "function":
@@ -240,30 +580,56 @@ func getTermboxAttr(captureName string) termbox.Attribute {
 	case "property":
 		cn = ColorTSProperty
 	default:
-		return termbox.ColorDefault
+		cn = ColorTSOther
 	}
+	return cn
+}
 
-	fg, _ := GetThemeColor(cn)
-	return fg
+// hashLine adds the highlight spans of line lineIdx to h, so draw can tell
+// whether the colors of the line changed.
+func (s *SyntaxHighlighter) hashLine(lineIdx int, h *rowHash) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if lineIdx < 0 || lineIdx >= len(s.Highlights) {
+		h.int(-1)
+		return
+	}
+	for _, span := range s.Highlights[lineIdx] {
+		h.int(int(span.Start))
+		h.int(int(span.End))
+		h.int(int(span.Color))
+	}
 }
 
-// Highlight returns a slice of attributes for each character in a line.
-func (s *SyntaxHighlighter) Highlight(lineIdx int, lineContent []rune) []termbox.Attribute {
-	attrs := make([]termbox.Attribute, len(lineContent))
-	// Fill with default foreground color first.
-	defaultFg, _ := GetThemeColor(ColorDefault)
-	for i := range attrs {
-		attrs[i] = defaultFg
+// Highlight sets attrs, which has the length of lineContent, to the
+// foreground color of each character of the line.
+func (s *SyntaxHighlighter) Highlight(lineIdx int, lineContent []rune, attrs []termbox.Attribute) {
+	colors := currentPalette.Load()
+	defaultFg := colors[ColorDefault].Foreground
+
+	// Until the worker catches up, lines may still hold spans from an older
+	// tree; they are used as-is.
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	var spans []HighlightSpan
+	if lineIdx >= 0 && lineIdx < len(s.Highlights) {
+		spans = s.Highlights[lineIdx]
 	}
 
-	// Apply cached highlights if they exist for this line.
-	if lineHighlights, ok := s.Highlights[lineIdx]; ok {
-		for col, color := range lineHighlights {
-			if col < len(attrs) {
-				attrs[col] = color
-			}
+	// Spans use byte columns, so walk the runes while tracking the byte
+	// offset of each one.
+	var offset uint32
+	k := 0
+	for i, r := range lineContent {
+		for k < len(spans) && spans[k].End <= offset {
+			k++
+		}
+		if k < len(spans) && spans[k].Start <= offset {
+			attrs[i] = colors[spans[k].Color].Foreground
+		} else {
+			attrs[i] = defaultFg
 		}
-	}
 
-	return attrs
+		offset += uint32(runeLen(r))
+	}
 }
@@ -2,8 +2,14 @@ package main
 
 // Color palette and theme used by the editor. Maps semantic color names (like
 // ColorNormalMode) to specific terminal attributes (foreground and background).
+// Themes are written as maps and compiled into an array indexed by color name,
+// which is what drawing and highlighting read.
 
-import "github.com/nsf/termbox-go"
+import (
+	"sync/atomic"
+
+	"github.com/nsf/termbox-go"
+)
 
 // To see available colors execute `qwe -colors`.
 
@@ -68,6 +74,7 @@ const (
 	ColorTSTag
 	ColorTSAttribute
 	ColorTSConstant
+	ColorTSOther // Captures without a color of their own.
 
 	// External service status indicators.
 	ColorLSPStatusConnected
@@ -78,6 +85,8 @@ const (
 	ColorHoverWindow // LSP hover information popup.
 	ColorAutocompleteWindow
 	ColorAutocompleteSelected
+
+	colorCount // Number of color names; must stay last.
 )
 
 // Theme maps each ColorName to its actual visual attributes.
@@ -149,11 +158,35 @@ var Theme = map[ColorName]Color{
 	ColorAutocompleteSelected: {Background: termbox.Attribute(239), Foreground: termbox.Attribute(255)},
 }
 
+// palette is a compiled theme. Names the theme does not define hold the zero
+// Color, which is the default terminal colors.
+type palette [colorCount]Color
+
+// currentPalette is the compiled current theme. It is replaced as a whole by
+// SetTheme, so the syntax workers can read it while the theme changes.
+var currentPalette atomic.Pointer[palette]
+
+func init() {
+	SetTheme(Theme)
+}
+
+// SetTheme makes theme the current theme. Everything drawn after the call
+// uses its colors.
+func SetTheme(theme map[ColorName]Color) {
+	p := new(palette)
+	for name, c := range theme {
+		if name >= 0 && name < colorCount {
+			p[name] = c
+		}
+	}
+	currentPalette.Store(p)
+}
+
 // GetThemeColor returns the foreground and background attributes for a given semantic name.
 func GetThemeColor(name ColorName) (termbox.Attribute, termbox.Attribute) {
-	if c, ok := Theme[name]; ok {
-		return c.Foreground, c.Background
+	if name < 0 || name >= colorCount {
+		return termbox.ColorDefault, termbox.ColorDefault
 	}
-	// Fallback to default if name is not found.
-	return termbox.ColorDefault, termbox.ColorDefault
+	c := &currentPalette.Load()[name]
+	return c.Foreground, c.Background
 }
@@ -0,0 +1,294 @@
+package main
+
+// File walk for the file finder. Directories are read concurrently with
+// os.ReadDir, whose entries already carry their type, so nothing is stat'ed.
+// The files found are handed out in batches while the walk goes on, and the
+// walk stops when its context is canceled. Paths matched by .gitignore files
+// or by Config.FuzzyExclude are skipped.
+
+import (
+	"context"
+	"os"
+	"path"
+	"path/filepath"
+	"runtime"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+)
+
+// walkBatchInterval is how often the files found are handed out.
+const walkBatchInterval = 50 * time.Millisecond
+
+// fileWalker is the state shared by the goroutines of a walk.
+type fileWalker struct {
+	ctx     context.Context
+	root    string
+	exclude *ignoreList // Patterns skipped everywhere, whatever .gitignore says.
+
+	mu     sync.Mutex
+	cond   *sync.Cond
+	dirs   []walkDir // Directories waiting to be read.
+	active int       // Directories waiting or being read.
+	found  []string  // Files found since the last batch.
+}
+
+// walkDir is a directory to read, relative to the root of the walk.
+type walkDir struct {
+	path   string
+	ignore *ignoreList // .gitignore rules that apply inside the directory.
+}
+
+// walkFiles walks the tree under root and calls emit with batches of the
+// files found, as paths relative to root. emit is called from one goroutine
+// at a time. walkFiles returns when the walk is done or ctx is canceled.
+func walkFiles(ctx context.Context, root string, exclude []string, emit func([]string)) {
+	w := &fileWalker{
+		ctx:     ctx,
+		root:    root,
+		exclude: &ignoreList{dir: ".", rules: parseIgnoreRules(strings.Join(exclude, "\n"))},
+		dirs:    []walkDir{{path: "."}},
+		active:  1,
+	}
+	w.cond = sync.NewCond(&w.mu)
+
+	// Wake the workers waiting for directories when the walk is canceled.
+	stop := context.AfterFunc(ctx, func() {
+		w.mu.Lock()
+		w.cond.Broadcast()
+		w.mu.Unlock()
+	})
+	defer stop()
+
+	var wg sync.WaitGroup
+	for i := 0; i < max(runtime.NumCPU(), 4); i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			w.work()
+		}()
+	}
+	done := make(chan struct{})
+	go func() {
+		wg.Wait()
+		close(done)
+	}()
+
+	ticker := time.NewTicker(walkBatchInterval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-ctx.Done():
+			return
+		case <-ticker.C:
+			w.flush(emit)
+		case <-done:
+			w.flush(emit)
+			return
+		}
+	}
+}
+
+// work reads directories until there are none left.
+func (w *fileWalker) work() {
+	for {
+		w.mu.Lock()
+		for len(w.dirs) == 0 && w.active > 0 && w.ctx.Err() == nil {
+			w.cond.Wait()
+		}
+		if len(w.dirs) == 0 || w.ctx.Err() != nil {
+			w.mu.Unlock()
+			return
+		}
+		// Taking the newest directory first keeps the queue short.
+		d := w.dirs[len(w.dirs)-1]
+		w.dirs = w.dirs[:len(w.dirs)-1]
+		w.mu.Unlock()
+
+		files, dirs := w.read(d)
+
+		w.mu.Lock()
+		w.found = append(w.found, files...)
+		w.dirs = append(w.dirs, dirs...)
+		w.active += len(dirs) - 1
+		if len(dirs) > 0 || w.active == 0 {
+			w.cond.Broadcast()
+		}
+		w.mu.Unlock()
+	}
+}
+
+// read lists directory d and returns the files and directories in it that
+// are not ignored.
+func (w *fileWalker) read(d walkDir) ([]string, []walkDir) {
+	entries, err := os.ReadDir(filepath.Join(w.root, filepath.FromSlash(d.path)))
+	if err != nil {
+		return nil, nil
+	}
+
+	ignore := d.ignore
+	for _, entry := range entries {
+		if entry.Name() == ".gitignore" && entry.Type().IsRegular() {
+			content, err := os.ReadFile(filepath.Join(w.root, filepath.FromSlash(d.path), ".gitignore"))
+			if err == nil {
+				ignore = &ignoreList{dir: d.path, rules: parseIgnoreRules(string(content)), parent: ignore}
+			}
+			break
+		}
+	}
+
+	var files []string
+	var dirs []walkDir
+	for _, entry := range entries {
+		p := path.Join(d.path, entry.Name())
+		isDir := entry.IsDir()
+		if w.exclude.ignored(p, isDir) || ignore.ignored(p, isDir) {
+			continue
+		}
+		if isDir {
+			dirs = append(dirs, walkDir{path: p, ignore: ignore})
+		} else {
+			files = append(files, filepath.FromSlash(p))
+		}
+	}
+	return files, dirs
+}
+
+// flush hands the files found since the last call to emit, in the order of
+// pathLess.
+func (w *fileWalker) flush(emit func([]string)) {
+	w.mu.Lock()
+	found := w.found
+	w.found = nil
+	w.mu.Unlock()
+
+	if len(found) > 0 && w.ctx.Err() == nil {
+		sort.Slice(found, func(i, j int) bool {
+			return pathLess(found[i], found[j])
+		})
+		emit(found)
+	}
+}
+
+// pathLess orders paths the way filepath.Walk visits them: by name within a
+// directory, with the files of a subdirectory right after its name.
+func pathLess(a, b string) bool {
+	for i := 0; i < len(a) && i < len(b); i++ {
+		if a[i] != b[i] {
+			if a[i] == filepath.Separator {
+				return true
+			}
+			if b[i] == filepath.Separator {
+				return false
+			}
+			return a[i] < b[i]
+		}
+	}
+	return len(a) < len(b)
+}
+
+// ignoreList holds the .gitignore rules of a directory. Through parent it
+// also holds those of the directories above it.
+type ignoreList struct {
+	dir    string // Directory the patterns are relative to.
+	rules  []ignoreRule
+	parent *ignoreList
+}
+
+// ignoreRule is one pattern of a .gitignore file.
+type ignoreRule struct {
+	segments []string // The pattern split at slashes.
+	negate   bool     // The pattern started with "!" and re-includes paths.
+	dirOnly  bool     // The pattern ended with "/" and only matches directories.
+	anchored bool     // The pattern contains a slash and is matched against the path from dir, not the name.
+}
+
+// parseIgnoreRules parses the patterns of a .gitignore file.
+func parseIgnoreRules(text string) []ignoreRule {
+	var rules []ignoreRule
+	for _, line := range strings.Split(text, "\n") {
+		line = strings.TrimRight(line, " \r")
+		if line == "" || line[0] == '#' {
+			continue
+		}
+
+		var r ignoreRule
+		if line[0] == '!' {
+			r.negate = true
+			line = line[1:]
+		} else if line[0] == '\\' {
+			line = line[1:] // Escaped "#" or "!".
+		}
+		if strings.HasSuffix(line, "/") {
+			r.dirOnly = true
+			line = strings.TrimRight(line, "/")
+		}
+		if line == "" {
+			continue
+		}
+		r.anchored = strings.Contains(line, "/")
+		r.segments = strings.Split(strings.TrimPrefix(line, "/"), "/")
+		rules = append(rules, r)
+	}
+	return rules
+}
+
+// ignored reports whether path p, relative to the root of the walk, is
+// ignored. Later rules override earlier ones, and the rules of a directory
+// override those of the directories above it.
+func (l *ignoreList) ignored(p string, isDir bool) bool {
+	name := path.Base(p)
+	for ; l != nil; l = l.parent {
+		rel := p
+		if l.dir != "." {
+			rel = strings.TrimPrefix(p, l.dir+"/")
+		}
+		for i := len(l.rules) - 1; i >= 0; i-- {
+			if l.rules[i].matches(rel, name, isDir) {
+				return !l.rules[i].negate
+			}
+		}
+	}
+	return false
+}
+
+// matches reports whether the rule matches the path rel, relative to the
+// directory of its .gitignore, whose last element is name.
+func (r *ignoreRule) matches(rel, name string, isDir bool) bool {
+	if r.dirOnly && !isDir {
+		return false
+	}
+	if !r.anchored {
+		ok, _ := path.Match(r.segments[0], name)
+		return ok
+	}
+	return matchSegments(r.segments, strings.Split(rel, "/"))
+}
+
+// matchSegments matches the elements of a path against the elements of a
+// pattern, where "**" matches any number of elements.
+func matchSegments(pattern, elems []string) bool {
+	for len(pattern) > 0 {
+		if pattern[0] == "**" {
+			pattern = pattern[1:]
+			if len(pattern) == 0 {
+				return true
+			}
+			for i := range elems {
+				if matchSegments(pattern, elems[i:]) {
+					return true
+				}
+			}
+			return false
+		}
+		if len(elems) == 0 {
+			return false
+		}
+		if ok, _ := path.Match(pattern[0], elems[0]); !ok {
+			return false
+		}
+		pattern, elems = pattern[1:], elems[1:]
+	}
+	return len(elems) == 0
+}